@@ -4,258 +4,522 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 // internal structures
+// lump name hash, open addressing keyed on the upper cased name packed
+// into 8 bytes. a later lump with the same name replaces the earlier one
+// so pwad lumps override the iwad the same way doom does
 typedef struct
 {
-    FILE        *fp;
-    char        name[8];
-    int         filepos;
-    int         size;
-} lumpinfo_t;
+        uint64_t        key;
+        int             lumpnum;
+} lumphashslot_t;
+
+typedef struct
+{
+        int             numslots;
+        int             numused;
+        lumphashslot_t  *slots;
+} lumphash_t;
 
-#define MAX_LUMPS       32 * 1024
-#define MAX_FILES        1 * 1024
+static uint64_t Lump_NameKey(const char *name)
+{
+        uint64_t        key = 0;
 
-static const char* wadname;
+        for(int i = 0; i < 8 && name[i]; i++)
+                key |= (uint64_t)(unsigned char)toupper((unsigned char)name[i]) << (i * 8);
 
-// internal lump data
-static int              numlumps;
-static lumpinfo_t       lumpdir[MAX_LUMPS];
-static void             *lumpdata[MAX_LUMPS];
-static int              numfiles;
-static FILE             *files[MAX_FILES];
+        return key;
+}
 
-static void *Doom_Malloc(int numbytes)
+static uint32_t LumpHash_Hash(uint64_t key)
 {
-        return malloc(numbytes);
+        return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32);
 }
 
-static int Doom_AddLump(char name[8], FILE *fp, int filepos, int size)
+static void LumpHash_Insert(lumphash_t *hash, uint64_t key, int lumpnum);
+
+static void LumpHash_Grow(lumphash_t *hash)
 {
-        lumpinfo_t      *lumpinfo;
+        int             numslots = hash->numslots;
+        lumphashslot_t  *slots = hash->slots;
 
-        // allocate an entry from the lump directory
-        lumpinfo = lumpdir + numlumps;
-        numlumps++;
+        // double the table and rehash everything
+        hash->numslots  = numslots ? numslots * 2 : 256;
+        hash->numused   = 0;
+        hash->slots     = (lumphashslot_t*)calloc(hash->numslots, sizeof(lumphashslot_t));
+        for(int i = 0; i < hash->numslots; i++)
+                hash->slots[i].lumpnum = -1;
 
-        lumpinfo->fp            = fp;
-        lumpinfo->filepos       = filepos;
-        lumpinfo->size          = size;
-        strncpy(lumpinfo->name, name, 8);
+        for(int i = 0; i < numslots; i++)
+        {
+                if(slots[i].lumpnum != -1)
+                        LumpHash_Insert(hash, slots[i].key, slots[i].lumpnum);
+        }
 
-        return numlumps - 1;
+        free(slots);
 }
-        
 
-// actually read the bytes of the lump
-static void Doom_ReadLump(int lumpnum)
+static void LumpHash_Insert(lumphash_t *hash, uint64_t key, int lumpnum)
 {
-        lumpinfo_t      *lumpinfo;
+        // keep the load factor under a half
+        if((hash->numused + 1) * 2 > hash->numslots)
+                LumpHash_Grow(hash);
 
-        lumpinfo = lumpdir + lumpnum;
+        uint32_t mask = hash->numslots - 1;
+        uint32_t i = LumpHash_Hash(key) & mask;
 
-        // don't load the lump if it's already been loaded or if it has zero size
-        if(lumpdata[lumpnum])
-                return;
-        if(!lumpinfo->size)
-                return;
-
-        // allocate memory for the lump
-        lumpdata[lumpnum] = Doom_Malloc(lumpinfo->size);
+        for(;; i = (i + 1) & mask)
+        {
+                lumphashslot_t *slot = hash->slots + i;
+
+                if(slot->lumpnum == -1)
+                {
+                        slot->key       = key;
+                        slot->lumpnum   = lumpnum;
+                        hash->numused++;
+                        return;
+                }
 
-        // read the lump data
-        fseek(lumpinfo->fp, lumpinfo->filepos, SEEK_SET);
-        fread(lumpdata[lumpnum], sizeof(unsigned char), lumpinfo->size, lumpinfo->fp);
+                // the last lump with a name wins
+                if(slot->key == key)
+                {
+                        slot->lumpnum   = lumpnum;
+                        return;
+                }
+        }
 }
 
-int Doom_LumpLength(int lumpnum)
+static int LumpHash_Find(const lumphash_t *hash, uint64_t key)
 {
-        lumpinfo_t *l = lumpdir + lumpnum;
-
-        return l->size;
-}
+        if(!hash->numslots)
+                return -1;
 
-int Doom_LumpNumFromName(const char *lumpname)
-{
-        lumpinfo_t      *l;
+        uint32_t mask = hash->numslots - 1;
+        uint32_t i = LumpHash_Hash(key) & mask;
 
-        for(l = lumpdir; l < lumpdir + numlumps; l++)
+        for(;; i = (i + 1) & mask)
         {
-                if(!strncmp(lumpname, l->name, 8))
-                        return (int)(l - lumpdir);
+                const lumphashslot_t *slot = hash->slots + i;
+
+                if(slot->lumpnum == -1)
+                        return -1;
+                if(slot->key == key)
+                        return slot->lumpnum;
         }
+}
 
-        return -1;
+static void LumpHash_Free(lumphash_t *hash)
+{
+        free(hash->slots);
+        hash->slots     = NULL;
+        hash->numslots  = 0;
+        hash->numused   = 0;
 }
 
-void *Doom_LumpFromNum(int lumpnum)
+typedef struct wadfile_s
 {
-        // range check the lump number
-        if(lumpnum < 0 || lumpnum > numlumps)
-                return NULL;
+        int             fd;
+        dwadheader_t    header;
+        int             numlumps;
+        dfilelump_t     *lumps;
+        lumphash_t      lumphash;
+        bool            ownsdirectory;
+
+        // used to check a sidecar index still matches the wad
+        char            *filename;
+        int64_t         filesize;
+        int64_t         filemtime;      // nanoseconds
+        int64_t         filectime;
+        uint64_t        fileinode;
+
+        // set when the file was opened with Wad_OpenMapped
+        unsigned char   *mapping;
+        size_t          mappingsize;
+
+        // set when the directory and hash came from a sidecar index
+        unsigned char   *index;
+        size_t          indexsize;
+
+        // async reads queued or running, guarded by iomutex
+        int             pendingreads;
+} wadfile_t;
 
-        Doom_ReadLump(lumpnum);
-        
-        return lumpdata[lumpnum];
-}
+// sidecar index file, "<wadfile>.idx". it holds the directory and the
+// lump name hash exactly as they are laid out in memory, followed by
+// the hash slots, so opening a wad is a single mmap of the index. the
+// wad's size, inode and modification and change times are kept to tell
+// if the wad has changed since, without reading its directory
+#define WADINDEX_ID             "WIDX"
+#define WADINDEX_VERSION        2
 
-void *Doom_LumpFromName(const char *lumpname)
+typedef struct
 {
-        return Doom_LumpFromNum(Doom_LumpNumFromName(lumpname));
+        char            id[4];
+        int             version;
+        int64_t         wadsize;
+        int64_t         wadmtime;
+        int64_t         wadctime;
+        uint64_t        wadinode;
+        dwadheader_t    header;
+        int             numslots;
+        int             numused;
+} dwadindex_t;
+
+static void Wad_BuildHash(wadfile_t *wadfile)
+{
+        for(int i = 0; i < wadfile->numlumps; i++) {
+                LumpHash_Insert(&wadfile->lumphash, Lump_NameKey(wadfile->lumps[i].name), i);
+        }
 }
 
-void Doom_ReadWadFile(const char *filename)
+static bool Wad_ValidId(const char id[4])
 {
-        FILE *fp;
-
-        fp = fopen(filename, "rb");
+        return !strncmp(id, "IWAD", 4) || !strncmp(id, "PWAD", 4);
+}
 
-        if(!fp)
-        {
-                printf("Failed to open wad file\n");
-                exit(-1);
+static bool Wad_ValidLumps(const dfilelump_t *lumps, int numlumps, int64_t filesize)
+{
+        for(int i = 0; i < numlumps; i++) {
+                if(lumps[i].filepos < 0
+                        || lumps[i].size < 0
+                        || (int64_t)lumps[i].filepos + lumps[i].size > filesize) {
+                        return false;
+                }
         }
 
-        wadname = filename;
-
-        files[numfiles] = fp;
-        numfiles++;
-
-        // read the header
-        dwadheader_t header;
-        fread(&header, sizeof(dwadheader_t), 1, fp);
-
-        // read the lump info table
-        fseek(fp, header.infotableofs, SEEK_SET);
+        return true;
+}
 
-        // iterate through the lumps and add the directory
-        for(int i = 0; i < header.numlumps; i++)
-        {
-                dfilelump_t     filelump;
-                lumpinfo_t      *lumpinfo; 
+static char *Wad_IndexName(const char *filename)
+{
+        size_t len = strlen(filename) + 5;
+        char *indexname = (char*)malloc(len);
 
-                // read the lump info
-                fread(&filelump, sizeof(dfilelump_t), 1, fp);
+        snprintf(indexname, len, "%s.idx", filename);
 
-                // allocate an entry from the lump directory
-                lumpinfo = lumpdir + numlumps;
-                numlumps++;
+        return indexname;
+}
 
-                lumpinfo->fp        = fp;
-                lumpinfo->filepos       = filelump.filepos;
-                lumpinfo->size          = filelump.size;
-                strncpy(lumpinfo->name, filelump.name, 8);
-        }
+// positional read, it doesn't touch the file offset so any number of
+// threads can read from the same descriptor at once
+static bool Wad_ReadAt(int fd, void *buffer, size_t size, off_t offset)
+{
+        unsigned char *p = (unsigned char*)buffer;
 
-        // re-read all the lumps
-        for(int i = 0; i < numlumps; i++)
-        {
-                if(lumpdata[i])
+        while(size) {
+                ssize_t count = pread(fd, p, size, offset);
+                if(count == -1 && errno == EINTR) {
                         continue;
+                }
+                if(count <= 0) {
+                        return false;
+                }
 
-                Doom_ReadLump(i);
+                p += count;
+                size -= count;
+                offset += count;
         }
+
+        return true;
 }
 
-void Doom_IterateLumps(void (*callback)(int lumpnum, char name[8], int size))
+static dfilelump_t *Wad_ReadDirectory(wadfile_t *wadfile)
 {
-        lumpinfo_t      *l;
+        size_t size = (size_t)wadfile->numlumps * sizeof(dfilelump_t);
+        dfilelump_t *lumps = (dfilelump_t*)malloc(size ? size : 1);
 
-        for(l = lumpdir; l < lumpdir + numlumps; l++)
-                callback(l - lumpdir, l->name, l->size);
+        // one read for the whole info table
+        if(!Wad_ReadAt(wadfile->fd, lumps, size, wadfile->header.infotableofs)) {
+                free(lumps);
+                return NULL;
+        }
+
+        return lumps;
 }
 
-void Doom_CloseAll()
+// use the sidecar index if there is one and the wad hasn't changed since
+// it was written. that's decided from the wad's stat alone so opening
+// through the index never reads the wad's directory. the index's lump
+// table is still bounds checked, views point straight into the mapping,
+// and so are the slots, which index the lump table
+static bool Wad_LoadIndex(wadfile_t *wadfile)
 {
-        int     i;
-
-        for(i = 0; i < numfiles; i++)
-        {
-                fclose(files[i]);
+        char *indexname = Wad_IndexName(wadfile->filename);
+        int fd = open(indexname, O_RDONLY);
+        free(indexname);
+        if(fd == -1) {
+                return false;
         }
 
-        for(i = 0; i < numlumps; i++)
-        {
-                if(!lumpdata[i])
-                        continue;
+        struct stat st;
+        dwadindex_t index;
+        if(fstat(fd, &st) == -1 || !Wad_ReadAt(fd, &index, sizeof(index), 0)) {
+                close(fd);
+                return false;
+        }
 
-                free(lumpdata[i]);
+        size_t expectedsize = sizeof(dwadindex_t)
+                + (size_t)wadfile->numlumps * sizeof(dfilelump_t)
+                + (size_t)index.numslots * sizeof(lumphashslot_t);
+
+        // a stale index is turned away before anything else is done with it
+        if(strncmp(index.id, WADINDEX_ID, 4)
+                || index.version != WADINDEX_VERSION
+                || index.wadsize != wadfile->filesize
+                || index.wadmtime != wadfile->filemtime
+                || index.wadctime != wadfile->filectime
+                || index.wadinode != wadfile->fileinode
+                || memcmp(&index.header, &wadfile->header, sizeof(dwadheader_t))
+                || index.numslots <= 0
+                || (index.numslots & (index.numslots - 1))
+                || index.numused < 0
+                || index.numused >= index.numslots
+                || (size_t)st.st_size != expectedsize) {
+                close(fd);
+                return false;
         }
-}
 
+        void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapping == MAP_FAILED) {
+                return false;
+        }
 
+        unsigned char *base = (unsigned char*)mapping;
+        dfilelump_t *indexlumps = (dfilelump_t*)(base + sizeof(dwadindex_t));
+        lumphashslot_t *indexslots = (lumphashslot_t*)(indexlumps + wadfile->numlumps);
 
-typedef struct wadfile_s
-{
-        FILE            *fp;
-        int             numlumps;
-        lumpinfo_t      *lumpinfo;
-} wadfile_t;
+        bool valid = Wad_ValidLumps(indexlumps, wadfile->numlumps, wadfile->filesize);
+        for(int i = 0; valid && i < index.numslots; i++) {
+                if(indexslots[i].lumpnum < -1 || indexslots[i].lumpnum >= wadfile->numlumps) {
+                        valid = false;
+                }
+        }
 
+        if(!valid) {
+                munmap(mapping, st.st_size);
+                return false;
+        }
 
-static int32_t ReadInt32(FILE *fp)
-{
-        int data;
-        fread(&data, sizeof(int32_t), 1, fp);
+        wadfile->index                  = base;
+        wadfile->indexsize              = st.st_size;
+        wadfile->lumps                  = indexlumps;
+        wadfile->ownsdirectory          = false;
+        wadfile->lumphash.numslots      = index.numslots;
+        wadfile->lumphash.numused       = index.numused;
+        wadfile->lumphash.slots         = indexslots;
 
-        return data;
+        return true;
 }
 
-static uint32_t ReadBytes(void *buffer, int count, FILE *fp)
+static void Wad_SetFileInfo(wadfile_t *wadfile, const char *filename, const struct stat *st)
 {
-    return fread(buffer, count, 1, fp);
+        wadfile->filename       = strdup(filename);
+        wadfile->filesize       = st->st_size;
+#ifdef __APPLE__
+        wadfile->filemtime      = (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+        wadfile->filectime      = (int64_t)st->st_ctimespec.tv_sec * 1000000000 + st->st_ctimespec.tv_nsec;
+#else
+        wadfile->filemtime      = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+        wadfile->filectime      = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+#endif
+        wadfile->fileinode      = st->st_ino;
 }
 
 wadfile_t *Wad_Open(const char *filename)
 {
         // open the wad file
-        FILE *fp = fopen(filename, "rb");
-        if(!fp) {
+        int fd = open(filename, O_RDONLY);
+        if(fd == -1) {
                 return NULL;
         }
 
-        // read the header
-        char id[4];
-        ReadBytes(&id, 4, fp);
-
-        if (!strncmp(id, "iwad", 4) || !strncmp(id, "pwad", 4)) {
-                fclose(fp);
+        struct stat st;
+        dwadheader_t header;
+        if(fstat(fd, &st) == -1
+                || !Wad_ReadAt(fd, &header, sizeof(dwadheader_t), 0)
+                || !Wad_ValidId(header.id)
+                || header.numlumps < 0) {
+                close(fd);
                 return NULL;
         }
 
-        int numlumps = ReadInt32(fp);
-        int infotableofs = ReadInt32(fp);
-
         // allocate the wad file pointer
-        wadfile_t *wadfile = (wadfile_t*)malloc(sizeof(wadfile_t));
-        wadfile->fp = fp;
-        wadfile->lumpinfo = (lumpinfo_t*)malloc(sizeof(lumpinfo_t) * numlumps);
-        wadfile->numlumps = numlumps;
-        
+        wadfile_t *wadfile = (wadfile_t*)calloc(1, sizeof(wadfile_t));
+        wadfile->fd = fd;
+        wadfile->header = header;
+        wadfile->numlumps = header.numlumps;
+        Wad_SetFileInfo(wadfile, filename, &st);
+
+        if(Wad_LoadIndex(wadfile)) {
+                return wadfile;
+        }
+
         // read the info table
-        fseek(fp, infotableofs, SEEK_SET);
+        wadfile->lumps = Wad_ReadDirectory(wadfile);
+        wadfile->ownsdirectory = true;
+        if(!wadfile->lumps) {
+                Wad_Close(wadfile);
+                return NULL;
+        }
 
-        for(int i = 0; i < numlumps; i++) {
-                // allocate an entry from the lump directory
-                lumpinfo_t *lumpinfo = wadfile->lumpinfo + i;
- 
-                // read the lumpinfo data
-                lumpinfo->filepos       = ReadInt32(fp);
-                lumpinfo->size          = ReadInt32(fp);
-                ReadBytes(lumpinfo->name, 8, fp);
+        Wad_BuildHash(wadfile);
+
+        return wadfile;
+}
+
+wadfile_t *Wad_OpenMapped(const char *filename)
+{
+        // map the whole file, the descriptor isn't needed once it's mapped
+        int fd = open(filename, O_RDONLY);
+        if(fd == -1) {
+                return NULL;
+        }
+
+        struct stat st;
+        if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(dwadheader_t)) {
+                close(fd);
+                return NULL;
+        }
+
+        void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapping == MAP_FAILED) {
+                return NULL;
+        }
+
+        unsigned char *base = (unsigned char*)mapping;
+        size_t size = st.st_size;
+
+        // check the header and make sure the info table lies inside the file
+        dwadheader_t *header = (dwadheader_t*)base;
+        if(!Wad_ValidId(header->id)
+                || header->numlumps < 0
+                || header->infotableofs < 0
+                || (size_t)header->infotableofs + (size_t)header->numlumps * sizeof(dfilelump_t) > size) {
+                munmap(mapping, size);
+                return NULL;
         }
 
+        // allocate the wad file pointer, the directory is used in place
+        wadfile_t *wadfile = (wadfile_t*)calloc(1, sizeof(wadfile_t));
+        wadfile->fd = -1;
+        wadfile->mapping = base;
+        wadfile->mappingsize = size;
+        wadfile->header = *header;
+        wadfile->numlumps = header->numlumps;
+        wadfile->lumps = (dfilelump_t*)(base + header->infotableofs);
+        Wad_SetFileInfo(wadfile, filename, &st);
+
+        // the index's lump table is bounds checked when it's loaded
+        if(Wad_LoadIndex(wadfile)) {
+                return wadfile;
+        }
+
+        // views point straight into the mapping so every lump has to be in bounds
+        if(!Wad_ValidLumps(wadfile->lumps, wadfile->numlumps, wadfile->filesize)) {
+                Wad_Close(wadfile);
+                return NULL;
+        }
+
+        Wad_BuildHash(wadfile);
+
         return wadfile;
 }
 
+static void Wad_DrainReads(wadfile_t *wadfile);
+
 void Wad_Close(wadfile_t *wadfile)
 {
-        fclose(wadfile->fp);
-        free(wadfile->lumpinfo);
+        // the i/o threads may still be reading from it
+        Wad_DrainReads(wadfile);
+
+        if(wadfile->index) {
+                munmap(wadfile->index, wadfile->indexsize);
+        } else {
+                LumpHash_Free(&wadfile->lumphash);
+        }
+
+        if(wadfile->ownsdirectory) {
+                free(wadfile->lumps);
+        }
+
+        if(wadfile->mapping) {
+                munmap(wadfile->mapping, wadfile->mappingsize);
+        } else {
+                close(wadfile->fd);
+        }
+
+        free(wadfile->filename);
         free(wadfile);
 }
 
+int Wad_WriteIndex(wadfile_t *wadfile)
+{
+        // mapped opens trust the index, so don't write one for a broken wad
+        if(!Wad_ValidLumps(wadfile->lumps, wadfile->numlumps, wadfile->filesize)) {
+                return -1;
+        }
+
+        dwadindex_t index;
+        memset(&index, 0, sizeof(index));
+        memcpy(index.id, WADINDEX_ID, 4);
+        index.version   = WADINDEX_VERSION;
+        index.wadsize   = wadfile->filesize;
+        index.wadmtime  = wadfile->filemtime;
+        index.wadctime  = wadfile->filectime;
+        index.wadinode  = wadfile->fileinode;
+        index.header    = wadfile->header;
+        index.numslots  = wadfile->lumphash.numslots;
+        index.numused   = wadfile->lumphash.numused;
+
+        // an empty wad still needs a valid table
+        lumphashslot_t emptyslot = { 0, -1 };
+        const lumphashslot_t *slots = wadfile->lumphash.slots;
+        if(!index.numslots) {
+                index.numslots = 1;
+                slots = &emptyslot;
+        }
+
+        // write to a temporary file and rename it over the old index so a
+        // reader never sees a partial file
+        char *indexname = Wad_IndexName(wadfile->filename);
+        size_t len = strlen(indexname) + 5;
+        char *tempname = (char*)malloc(len);
+        snprintf(tempname, len, "%s.tmp", indexname);
+
+        int result = -1;
+        FILE *fp = fopen(tempname, "wb");
+        if(fp) {
+                bool ok = fwrite(&index, sizeof(index), 1, fp) == 1;
+                ok = ok && fwrite(wadfile->lumps, sizeof(dfilelump_t), wadfile->numlumps, fp) == (size_t)wadfile->numlumps;
+                ok = ok && fwrite(slots, sizeof(lumphashslot_t), index.numslots, fp) == (size_t)index.numslots;
+                ok = (fclose(fp) == 0) && ok;
+
+                if(ok && rename(tempname, indexname) == 0) {
+                        result = 0;
+                } else {
+                        remove(tempname);
+                }
+        }
+
+        free(tempname);
+        free(indexname);
+
+        return result;
+}
+
 int Wad_NumLumps(wadfile_t *wadfile)
 {
         return wadfile->numlumps;
@@ -263,42 +527,48 @@ int Wad_NumLumps(wadfile_t *wadfile)
 
 int Wad_LumpSize(wadfile_t *wadfile, int lumpnum)
 {
-        return wadfile->lumpinfo[lumpnum].size;
+        return wadfile->lumps[lumpnum].size;
 }
 
 int Wad_LumpOffset(wadfile_t *wadfile, int lumpnum)
 {
-        return wadfile->lumpinfo[lumpnum].filepos;
+        return wadfile->lumps[lumpnum].filepos;
 }
 
 const char* Wad_LumpName(wadfile_t *wadfile, int lumpnum)
 {
-        return wadfile->lumpinfo[lumpnum].name;
+        return wadfile->lumps[lumpnum].name;
 }
 
 int Wad_LumpNumFromName(wadfile_t *wadfile, const char *lumpname)
 {
-        for(int i = 0; i < wadfile->numlumps; i++) {
-                if(!strncmp(lumpname, wadfile->lumpinfo[i].name, 8)) {
-                        return i;
-                }
+        return LumpHash_Find(&wadfile->lumphash, Lump_NameKey(lumpname));
+}
+
+// copy a whole lump into a buffer
+static bool Wad_CopyLump(wadfile_t *wadfile, int lumpnum, void *buffer)
+{
+        dfilelump_t* lumpinfo = wadfile->lumps + lumpnum;
+
+        // mapped files are just a copy out of the mapping
+        if(wadfile->mapping) {
+                memcpy(buffer, wadfile->mapping + lumpinfo->filepos, lumpinfo->size);
+                return true;
         }
 
-        return -1;
+        // copy it out from the file
+        return Wad_ReadAt(wadfile->fd, buffer, lumpinfo->size, lumpinfo->filepos);
 }
 
 void* Wad_ReadLump(wadfile_t *wadfile, int lumpnum)
 {
-        lumpinfo_t* lumpinfo = wadfile->lumpinfo + lumpnum;
-
         // allocate memory for the lump
-        void* buffer = malloc(lumpinfo->size);
-
-        // seek to the data position
-        fseek(wadfile->fp, lumpinfo->filepos, SEEK_SET);
+        void* buffer = malloc(wadfile->lumps[lumpnum].size);
 
-        // copy it out from the file
-        fread(buffer, lumpinfo->size, 1, wadfile->fp);
+        if(!Wad_CopyLump(wadfile, lumpnum, buffer)) {
+                free(buffer);
+                return NULL;
+        }
         
         return buffer;
 }
@@ -308,3 +578,1209 @@ void Wad_FreeLump(unsigned char *data)
         free(data);
 }
 
+int Wad_ReadLumpInto(wadfile_t *wadfile, int lumpnum, void *buffer, int buffersize)
+{
+        int size = wadfile->lumps[lumpnum].size;
+
+        if(size > buffersize || !Wad_CopyLump(wadfile, lumpnum, buffer)) {
+                return -1;
+        }
+
+        return size;
+}
+
+// batch reads
+//
+// the requests are sorted by file position and neighbouring lumps are
+// merged into one preadv, small gaps between them are read into a scratch
+// buffer rather than splitting the read
+#define WAD_MAX_READ_GAP        (16 * 1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX                 1024
+#endif
+
+typedef struct
+{
+        int             filepos;
+        int             read;
+} wadreadkey_t;
+
+static int Wad_CompareReads(const void *a, const void *b)
+{
+        const wadreadkey_t *ka = (const wadreadkey_t*)a;
+        const wadreadkey_t *kb = (const wadreadkey_t*)b;
+
+        if(ka->filepos != kb->filepos) {
+                return ka->filepos < kb->filepos ? -1 : 1;
+        }
+
+        return ka->read - kb->read;
+}
+
+static bool Wad_ReadRange(wadfile_t *wadfile, wadread_t **reads, int numreads, unsigned char *scratch)
+{
+        struct iovec iov[IOV_MAX];
+        int numiov = 0;
+        size_t total = 0;
+        int start = wadfile->lumps[reads[0]->lumpnum].filepos;
+        int pos = start;
+
+        for(int i = 0; i < numreads; i++) {
+                dfilelump_t *lumpinfo = wadfile->lumps + reads[i]->lumpnum;
+
+                if(lumpinfo->filepos > pos) {
+                        iov[numiov].iov_base = scratch;
+                        iov[numiov].iov_len = lumpinfo->filepos - pos;
+                        total += iov[numiov].iov_len;
+                        numiov++;
+                }
+
+                iov[numiov].iov_base = reads[i]->buffer;
+                iov[numiov].iov_len = lumpinfo->size;
+                total += iov[numiov].iov_len;
+                numiov++;
+
+                pos = lumpinfo->filepos + lumpinfo->size;
+        }
+
+        ssize_t count;
+        do {
+                count = preadv(wadfile->fd, iov, numiov, start);
+        } while(count == -1 && errno == EINTR);
+
+        if(count == (ssize_t)total) {
+                return true;
+        }
+
+        // a short read, just do the lumps one at a time
+        for(int i = 0; i < numreads; i++) {
+                if(!Wad_CopyLump(wadfile, reads[i]->lumpnum, reads[i]->buffer)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+int Wad_ReadLumps(wadfile_t *wadfile, wadread_t *reads, int numreads)
+{
+        // mapped files have nothing to merge
+        if(wadfile->mapping) {
+                for(int i = 0; i < numreads; i++) {
+                        Wad_CopyLump(wadfile, reads[i].lumpnum, reads[i].buffer);
+                }
+
+                return 0;
+        }
+
+        // sort the non empty reads by file position
+        wadreadkey_t *keys = (wadreadkey_t*)malloc(sizeof(wadreadkey_t) * (numreads ? numreads : 1));
+        wadread_t **sorted = (wadread_t**)malloc(sizeof(wadread_t*) * (numreads ? numreads : 1));
+        int numsorted = 0;
+
+        for(int i = 0; i < numreads; i++) {
+                if(wadfile->lumps[reads[i].lumpnum].size) {
+                        keys[numsorted].filepos = wadfile->lumps[reads[i].lumpnum].filepos;
+                        keys[numsorted].read = i;
+                        numsorted++;
+                }
+        }
+
+        qsort(keys, numsorted, sizeof(wadreadkey_t), Wad_CompareReads);
+
+        for(int i = 0; i < numsorted; i++) {
+                sorted[i] = reads + keys[i].read;
+        }
+        free(keys);
+
+        unsigned char *scratch = (unsigned char*)malloc(WAD_MAX_READ_GAP);
+        int result = 0;
+
+        // walk the sorted reads merging runs that are close together
+        for(int first = 0; first < numsorted; ) {
+                dfilelump_t *lumpinfo = wadfile->lumps + sorted[first]->lumpnum;
+                int end = lumpinfo->filepos + lumpinfo->size;
+                int last = first + 1;
+
+                // each lump needs an iovec and maybe one for the gap before it
+                while(last < numsorted && (last - first) * 2 < IOV_MAX) {
+                        dfilelump_t *next = wadfile->lumps + sorted[last]->lumpnum;
+
+                        // lumps that overlap the run or are too far away start a new one
+                        if(next->filepos < end || next->filepos - end > WAD_MAX_READ_GAP) {
+                                break;
+                        }
+
+                        end = next->filepos + next->size;
+                        last++;
+                }
+
+                if(!Wad_ReadRange(wadfile, sorted + first, last - first, scratch)) {
+                        result = -1;
+                }
+
+                first = last;
+        }
+
+        free(scratch);
+        free(sorted);
+
+        return result;
+}
+
+const void* Wad_LumpView(wadfile_t *wadfile, int lumpnum, int *size)
+{
+        if(!wadfile->mapping) {
+                return NULL;
+        }
+
+        dfilelump_t* lumpinfo = wadfile->lumps + lumpnum;
+
+        if(size) {
+                *size = lumpinfo->size;
+        }
+
+        return wadfile->mapping + lumpinfo->filepos;
+}
+
+
+
+// asynchronous reads
+//
+// prefetching hands the lump ranges to the kernel as readahead hints so no
+// thread is needed. async reads go through a small pool of i/o threads that
+// is started on first use, the threads just call Wad_ReadLump which is safe
+// to call from any number of threads
+#define WAD_IO_THREADS  4
+
+typedef struct wadrequest_s
+{
+        wadfile_t               *wadfile;
+        int                     lumpnum;
+        wadreadfunc_t           callback;
+        void                    *userdata;
+
+        void                    *data;
+        bool                    done;
+
+        struct wadrequest_s     *next;
+} wadrequest_t;
+
+static pthread_mutex_t  iomutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   iowork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   iodone = PTHREAD_COND_INITIALIZER;
+static bool             iostarted;
+static wadrequest_t     *iohead;
+static wadrequest_t     *iotail;
+
+static void *Wad_IOThread(void *arg)
+{
+        (void)arg;
+
+        for(;;) {
+                // wait for a request
+                pthread_mutex_lock(&iomutex);
+                while(!iohead) {
+                        pthread_cond_wait(&iowork, &iomutex);
+                }
+
+                wadrequest_t *request = iohead;
+                iohead = request->next;
+                if(!iohead) {
+                        iotail = NULL;
+                }
+                pthread_mutex_unlock(&iomutex);
+
+                wadfile_t *wadfile = request->wadfile;
+                void *data = Wad_ReadLump(wadfile, request->lumpnum);
+
+                // callback requests are owned by the i/o thread
+                if(request->callback) {
+                        request->callback(wadfile, request->lumpnum, data, request->userdata);
+                        free(request);
+                        request = NULL;
+                }
+
+                // the wad file can be closed once the count reaches zero
+                pthread_mutex_lock(&iomutex);
+                if(request) {
+                        request->data = data;
+                        request->done = true;
+                }
+                wadfile->pendingreads--;
+                pthread_cond_broadcast(&iodone);
+                pthread_mutex_unlock(&iomutex);
+        }
+
+        return NULL;
+}
+
+// called with iomutex held
+static void Wad_StartIOThreads()
+{
+        if(iostarted) {
+                return;
+        }
+
+        for(int i = 0; i < WAD_IO_THREADS; i++) {
+                pthread_t thread;
+                pthread_create(&thread, NULL, Wad_IOThread, NULL);
+                pthread_detach(thread);
+        }
+
+        iostarted = true;
+}
+
+void Wad_PrefetchLumps(wadfile_t *wadfile, const int *lumpnums, int numlumps)
+{
+        for(int i = 0; i < numlumps; i++) {
+                // it's only a hint, a bad lump number is skipped
+                if(lumpnums[i] < 0 || lumpnums[i] >= wadfile->numlumps) {
+                        continue;
+                }
+
+                dfilelump_t *lumpinfo = wadfile->lumps + lumpnums[i];
+
+                if(!lumpinfo->size) {
+                        continue;
+                }
+
+                if(wadfile->mapping) {
+                        // madvise wants a page aligned start
+                        size_t pagemask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+                        size_t start = (size_t)lumpinfo->filepos & ~pagemask;
+                        size_t end = (size_t)lumpinfo->filepos + lumpinfo->size;
+
+                        madvise(wadfile->mapping + start, end - start, MADV_WILLNEED);
+                } else {
+#ifdef POSIX_FADV_WILLNEED
+                        posix_fadvise(wadfile->fd, lumpinfo->filepos, lumpinfo->size, POSIX_FADV_WILLNEED);
+#endif
+                }
+        }
+}
+
+wadrequest_t *Wad_ReadLumpAsync(wadfile_t *wadfile, int lumpnum, wadreadfunc_t callback, void *userdata)
+{
+        wadrequest_t *request = (wadrequest_t*)calloc(1, sizeof(wadrequest_t));
+        request->wadfile        = wadfile;
+        request->lumpnum        = lumpnum;
+        request->callback       = callback;
+        request->userdata       = userdata;
+
+        // queue it up for the i/o threads
+        pthread_mutex_lock(&iomutex);
+        Wad_StartIOThreads();
+
+        wadfile->pendingreads++;
+
+        if(iotail) {
+                iotail->next = request;
+        } else {
+                iohead = request;
+        }
+        iotail = request;
+
+        pthread_cond_signal(&iowork);
+        pthread_mutex_unlock(&iomutex);
+
+        return callback ? NULL : request;
+}
+
+bool Wad_LumpReady(wadrequest_t *request)
+{
+        pthread_mutex_lock(&iomutex);
+        bool done = request->done;
+        pthread_mutex_unlock(&iomutex);
+
+        return done;
+}
+
+// wait for every async read on the wad file to finish, including callbacks
+static void Wad_DrainReads(wadfile_t *wadfile)
+{
+        pthread_mutex_lock(&iomutex);
+        while(wadfile->pendingreads) {
+                pthread_cond_wait(&iodone, &iomutex);
+        }
+        pthread_mutex_unlock(&iomutex);
+}
+
+void *Wad_WaitLump(wadrequest_t *request)
+{
+        pthread_mutex_lock(&iomutex);
+        while(!request->done) {
+                pthread_cond_wait(&iodone, &iomutex);
+        }
+        pthread_mutex_unlock(&iomutex);
+
+        void *data = request->data;
+        free(request);
+
+        return data;
+}
+
+
+
+// resource stack, the iwad followed by the pwads in the order they were
+// added. each lump in the stack refers back to its file and its lump
+// number in that file, the name hash resolves pwad overrides. everything
+// grows as files are added
+typedef struct
+{
+        int             file;
+        int             lumpnum;
+} lumpinfo_t;
+
+// lump cache state, loaded lumps are kept on a list in the order they
+// were last used so the least recently used ones can be evicted
+typedef struct
+{
+        void            *data;
+        bool            inarena;
+        int             pincount;
+        int             prev;
+        int             next;
+} lumpcache_t;
+
+// lump data arena. with no cache budget lumps are never freed one at a
+// time, so they're carved out of large cache line aligned blocks and all
+// released together by Doom_ResetArena. the blocks are kept and reused
+// so walking the maps of a wad doesn't go back to the heap for each one
+#define ARENA_BLOCK_SIZE        (1024 * 1024)
+#define ARENA_ALIGN             64
+
+typedef struct arenablock_s
+{
+        struct arenablock_s     *next;
+        size_t                  size;
+        size_t                  used;
+        unsigned char           *data;
+} arenablock_t;
+
+typedef struct
+{
+        arenablock_t            *blocks;
+        arenablock_t            *current;
+} arena_t;
+
+static arena_t          lumparena;
+
+typedef struct
+{
+        int             numfiles;
+        int             maxfiles;
+        wadfile_t       **files;
+
+        int             numlumps;
+        int             maxlumps;
+        lumpinfo_t      *lumps;
+        lumpcache_t     *cache;
+        lumphash_t      lumphash;
+
+        // cache budget in bytes, zero means no limit
+        int             cachebudget;
+        int             cachedbytes;
+        int             lruhead;
+        int             lrutail;
+} resstack_t;
+
+static resstack_t       resstack = { 0, 0, NULL, 0, 0, NULL, NULL, { 0, 0, NULL }, 0, 0, -1, -1 };
+
+static arenablock_t *Arena_NewBlock(size_t size)
+{
+        void            *data;
+        arenablock_t    *block;
+
+        if(posix_memalign(&data, ARENA_ALIGN, size))
+                return NULL;
+
+        block           = (arenablock_t*)malloc(sizeof(arenablock_t));
+        block->next     = NULL;
+        block->size     = size;
+        block->used     = 0;
+        block->data     = (unsigned char*)data;
+
+        return block;
+}
+
+static void *Arena_Alloc(arena_t *arena, size_t numbytes)
+{
+        arenablock_t    *block;
+
+        numbytes = (numbytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+        // move along the blocks kept from before the last reset
+        for(block = arena->current; block; block = block->next)
+        {
+                if(block->used + numbytes <= block->size)
+                        break;
+        }
+
+        // lumps bigger than a block get a block of their own
+        if(!block)
+        {
+                block = Arena_NewBlock(numbytes > ARENA_BLOCK_SIZE ? numbytes : ARENA_BLOCK_SIZE);
+                if(!block)
+                        return NULL;
+
+                if(arena->current)
+                {
+                        arenablock_t *last = arena->current;
+                        while(last->next)
+                                last = last->next;
+                        last->next = block;
+                }
+                else
+                        arena->blocks = block;
+        }
+
+        arena->current = block;
+
+        void *p = block->data + block->used;
+        block->used += numbytes;
+
+        return p;
+}
+
+static void Arena_Reset(arena_t *arena)
+{
+        for(arenablock_t *block = arena->blocks; block; block = block->next)
+                block->used = 0;
+
+        arena->current = arena->blocks;
+}
+
+static void Arena_Free(arena_t *arena)
+{
+        arenablock_t    *block, *next;
+
+        for(block = arena->blocks; block; block = next)
+        {
+                next = block->next;
+                free(block->data);
+                free(block);
+        }
+
+        arena->blocks = NULL;
+        arena->current = NULL;
+}
+
+// lumps come from the arena unless a budget is set, evicting only gives
+// memory back if the lump was allocated on its own
+static void Doom_AllocLumpData(lumpcache_t *c, int numbytes)
+{
+        c->inarena = !resstack.cachebudget;
+
+        if(c->inarena)
+                c->data = Arena_Alloc(&lumparena, numbytes);
+        else
+                c->data = malloc(numbytes);
+}
+
+static void Doom_FreeLumpData(lumpcache_t *c)
+{
+        if(!c->inarena)
+                free(c->data);
+
+        c->data = NULL;
+}
+
+static dfilelump_t *Doom_FileLump(int lumpnum)
+{
+        lumpinfo_t      *l = resstack.lumps + lumpnum;
+
+        return resstack.files[l->file]->lumps + l->lumpnum;
+}
+
+static int Doom_AddFile(wadfile_t *wadfile)
+{
+        if(resstack.numfiles == resstack.maxfiles)
+        {
+                resstack.maxfiles       = resstack.maxfiles ? resstack.maxfiles * 2 : 4;
+                resstack.files          = (wadfile_t**)realloc(resstack.files, resstack.maxfiles * sizeof(wadfile_t*));
+        }
+
+        resstack.files[resstack.numfiles] = wadfile;
+        resstack.numfiles++;
+
+        return resstack.numfiles - 1;
+}
+
+static int Doom_AddLump(int file, int lumpnum)
+{
+        lumpinfo_t      *lumpinfo;
+        lumpcache_t     *c;
+
+        if(resstack.numlumps == resstack.maxlumps)
+        {
+                resstack.maxlumps       = resstack.maxlumps ? resstack.maxlumps * 2 : 1024;
+                resstack.lumps          = (lumpinfo_t*)realloc(resstack.lumps, resstack.maxlumps * sizeof(lumpinfo_t));
+                resstack.cache          = (lumpcache_t*)realloc(resstack.cache, resstack.maxlumps * sizeof(lumpcache_t));
+        }
+
+        // allocate an entry from the lump directory
+        lumpinfo = resstack.lumps + resstack.numlumps;
+        c = resstack.cache + resstack.numlumps;
+        resstack.numlumps++;
+
+        lumpinfo->file          = file;
+        lumpinfo->lumpnum       = lumpnum;
+
+        c->data                 = NULL;
+        c->inarena              = false;
+        c->pincount             = 0;
+        c->prev                 = -1;
+        c->next                 = -1;
+
+        LumpHash_Insert(&resstack.lumphash, Lump_NameKey(Doom_FileLump(resstack.numlumps - 1)->name), resstack.numlumps - 1);
+
+        return resstack.numlumps - 1;
+}
+
+static void Doom_UnlinkLump(int lumpnum)
+{
+        lumpcache_t     *c = resstack.cache + lumpnum;
+
+        if(c->prev != -1)
+                resstack.cache[c->prev].next = c->next;
+        else
+                resstack.lruhead = c->next;
+
+        if(c->next != -1)
+                resstack.cache[c->next].prev = c->prev;
+        else
+                resstack.lrutail = c->prev;
+
+        c->prev = -1;
+        c->next = -1;
+}
+
+// put a lump at the most recently used end of the list
+static void Doom_LinkLump(int lumpnum)
+{
+        lumpcache_t     *c = resstack.cache + lumpnum;
+
+        c->prev = -1;
+        c->next = resstack.lruhead;
+
+        if(resstack.lruhead != -1)
+                resstack.cache[resstack.lruhead].prev = lumpnum;
+        else
+                resstack.lrutail = lumpnum;
+
+        resstack.lruhead = lumpnum;
+}
+
+static void Doom_EvictLump(int lumpnum)
+{
+        lumpcache_t     *c = resstack.cache + lumpnum;
+
+        Doom_UnlinkLump(lumpnum);
+
+        Doom_FreeLumpData(c);
+        resstack.cachedbytes -= Doom_LumpLength(lumpnum);
+}
+
+// evict unpinned lumps, oldest first, until numbytes more will fit in the budget
+static void Doom_MakeRoom(int numbytes)
+{
+        int     lumpnum, prev;
+
+        if(!resstack.cachebudget)
+                return;
+
+        for(lumpnum = resstack.lrutail; lumpnum != -1 && resstack.cachedbytes + numbytes > resstack.cachebudget; lumpnum = prev)
+        {
+                prev = resstack.cache[lumpnum].prev;
+
+                if(resstack.cache[lumpnum].pincount)
+                        continue;
+
+                Doom_EvictLump(lumpnum);
+        }
+}
+
+// actually read the bytes of the lump
+static void Doom_ReadLump(int lumpnum)
+{
+        lumpinfo_t      *lumpinfo;
+        lumpcache_t     *c;
+        int             size;
+
+        lumpinfo = resstack.lumps + lumpnum;
+        c = resstack.cache + lumpnum;
+        size = Doom_LumpLength(lumpnum);
+
+        // don't load the lump if it's already been loaded or if it has zero size
+        if(c->data)
+        {
+                Doom_UnlinkLump(lumpnum);
+                Doom_LinkLump(lumpnum);
+                return;
+        }
+        if(!size)
+                return;
+
+        // the budget is soft, if everything is pinned the lump is loaded anyway
+        Doom_MakeRoom(size);
+
+        // allocate memory for the lump and read the lump data
+        Doom_AllocLumpData(c, size);
+        if(!c->data)
+                return;
+        if(!Wad_CopyLump(resstack.files[lumpinfo->file], lumpinfo->lumpnum, c->data))
+        {
+                Doom_FreeLumpData(c);
+                return;
+        }
+
+        resstack.cachedbytes += size;
+        Doom_LinkLump(lumpnum);
+}
+
+int Doom_LumpLength(int lumpnum)
+{
+        return Doom_FileLump(lumpnum)->size;
+}
+
+int Doom_LumpNumFromName(const char *lumpname)
+{
+        return LumpHash_Find(&resstack.lumphash, Lump_NameKey(lumpname));
+}
+
+void *Doom_LumpFromNum(int lumpnum)
+{
+        // range check the lump number
+        if(lumpnum < 0 || lumpnum >= resstack.numlumps)
+                return NULL;
+
+        Doom_ReadLump(lumpnum);
+        
+        return resstack.cache[lumpnum].data;
+}
+
+void *Doom_LumpFromName(const char *lumpname)
+{
+        return Doom_LumpFromNum(Doom_LumpNumFromName(lumpname));
+}
+
+void Doom_CacheLumps(const int *lumpnums, int numlumps)
+{
+        wadread_t       *reads;
+        int             *readlumps;
+        int             numreads;
+        int             numbytes;
+        int             i;
+
+        reads           = (wadread_t*)malloc(sizeof(wadread_t) * (numlumps ? numlumps : 1));
+        readlumps       = (int*)malloc(sizeof(int) * (numlumps ? numlumps : 1));
+        numreads        = 0;
+
+        // make room for everything that isn't loaded yet in one go so
+        // lumps from this batch can't evict each other
+        numbytes = 0;
+        for(i = 0; i < numlumps; i++)
+        {
+                int lumpnum = lumpnums[i];
+
+                if(lumpnum < 0 || lumpnum >= resstack.numlumps || resstack.cache[lumpnum].data)
+                        continue;
+
+                numbytes += Doom_LumpLength(lumpnum);
+        }
+
+        Doom_MakeRoom(numbytes);
+
+        for(i = 0; i < numlumps; i++)
+        {
+                int             lumpnum = lumpnums[i];
+                lumpcache_t     *c;
+                int             size;
+
+                if(lumpnum < 0 || lumpnum >= resstack.numlumps)
+                        continue;
+
+                c = resstack.cache + lumpnum;
+                size = Doom_LumpLength(lumpnum);
+
+                if(c->data)
+                {
+                        Doom_UnlinkLump(lumpnum);
+                        Doom_LinkLump(lumpnum);
+                        continue;
+                }
+                if(!size)
+                        continue;
+
+                Doom_AllocLumpData(c, size);
+                if(!c->data)
+                        continue;
+
+                resstack.cachedbytes += size;
+                Doom_LinkLump(lumpnum);
+
+                reads[numreads].lumpnum = resstack.lumps[lumpnum].lumpnum;
+                reads[numreads].buffer  = c->data;
+                readlumps[numreads]     = lumpnum;
+                numreads++;
+        }
+
+        // issue one batch per file, a map's lumps are all in one file so
+        // they usually come in as a single read
+        for(int file = 0; file < resstack.numfiles && numreads; file++)
+        {
+                wadread_t       *batch;
+                int             numbatch = 0;
+
+                batch = (wadread_t*)malloc(sizeof(wadread_t) * numreads);
+                for(i = 0; i < numreads; i++)
+                {
+                        if(resstack.lumps[readlumps[i]].file == file)
+                                batch[numbatch++] = reads[i];
+                }
+
+                // drop the lumps again if the reads failed
+                if(numbatch && Wad_ReadLumps(resstack.files[file], batch, numbatch) == -1)
+                {
+                        for(i = 0; i < numreads; i++)
+                        {
+                                if(resstack.lumps[readlumps[i]].file == file)
+                                        Doom_EvictLump(readlumps[i]);
+                        }
+                }
+
+                free(batch);
+        }
+
+        free(reads);
+        free(readlumps);
+}
+
+void *Doom_PinLump(int lumpnum)
+{
+        void    *data;
+
+        data = Doom_LumpFromNum(lumpnum);
+        if(data)
+                resstack.cache[lumpnum].pincount++;
+
+        return data;
+}
+
+void Doom_UnpinLump(int lumpnum)
+{
+        if(lumpnum < 0 || lumpnum >= resstack.numlumps)
+                return;
+
+        if(resstack.cache[lumpnum].pincount)
+                resstack.cache[lumpnum].pincount--;
+}
+
+void Doom_SetCacheBudget(int numbytes)
+{
+        resstack.cachebudget = numbytes;
+
+        Doom_MakeRoom(0);
+}
+
+int Doom_CachedBytes()
+{
+        return resstack.cachedbytes;
+}
+
+int Doom_NumLumps()
+{
+        return resstack.numlumps;
+}
+
+const char *Doom_LumpName(int lumpnum)
+{
+        return Doom_FileLump(lumpnum)->name;
+}
+
+void Doom_ResetArena()
+{
+        for(int i = 0; i < resstack.numlumps; i++)
+        {
+                lumpcache_t *c = resstack.cache + i;
+
+                if(!c->data)
+                        continue;
+
+                Doom_UnlinkLump(i);
+                Doom_FreeLumpData(c);
+                c->pincount = 0;
+        }
+
+        resstack.cachedbytes = 0;
+
+        Arena_Reset(&lumparena);
+}
+
+void Doom_ReadWadFile(const char *filename)
+{
+        wadfile_t *wadfile;
+
+        // map the wad when we can so maps are viewed in place
+        wadfile = Wad_OpenMapped(filename);
+        if(!wadfile)
+                wadfile = Wad_Open(filename);
+
+        if(!wadfile)
+        {
+                printf("Failed to open wad file\n");
+                exit(-1);
+        }
+
+        int file = Doom_AddFile(wadfile);
+
+        // add the directory, the lump data itself is read the first time
+        // it's asked for
+        for(int i = 0; i < Wad_NumLumps(wadfile); i++)
+                Doom_AddLump(file, i);
+}
+
+void Doom_IterateLumps(void (*callback)(int lumpnum, char name[8], int size))
+{
+        for(int i = 0; i < resstack.numlumps; i++)
+        {
+                dfilelump_t *l = Doom_FileLump(i);
+
+                callback(i, l->name, l->size);
+        }
+}
+
+void Doom_CloseAll()
+{
+        int     i;
+
+        for(i = 0; i < resstack.numlumps; i++)
+                Doom_FreeLumpData(resstack.cache + i);
+
+        Arena_Free(&lumparena);
+
+        for(i = 0; i < resstack.numfiles; i++)
+                Wad_Close(resstack.files[i]);
+
+        free(resstack.files);
+        free(resstack.lumps);
+        free(resstack.cache);
+        LumpHash_Free(&resstack.lumphash);
+
+        // leave the stack empty so more files can be read
+        memset(&resstack, 0, sizeof(resstack));
+        resstack.lruhead = -1;
+        resstack.lrutail = -1;
+}
+
+
+
+// map loading
+
+static const char *maplumpnames[] =
+{
+        "THINGS",
+        "LINEDEFS",
+        "SIDEDEFS",
+        "VERTEXES",
+        "SEGS",
+        "SSECTORS",
+        "NODES",
+        "SECTORS",
+        "REJECT",
+        "BLOCKMAP"
+};
+
+#define NUM_MAP_LUMPS           (BLOCK_OFFSET - THINGS_OFFSET + 1)
+#define NUM_REQUIRED_MAP_LUMPS  (SECTORS_OFFSET - THINGS_OFFSET + 1)
+
+// the nodes can be in any order but the root is the last one. walking
+// down from it no node may be reached twice, which keeps loops and shared
+// subtrees out. nodes that can't be reached are left alone
+static bool Doom_CheckNodeTree(const mapview_t *map)
+{
+        unsigned char   reached[0x8000 / 8];
+        unsigned short  stack[0x8000 + 1];
+        int             top = 0;
+
+        memset(reached, 0, sizeof(reached));
+
+        stack[top++] = map->numnodes - 1;
+
+        while(top)
+        {
+                unsigned short num = stack[--top];
+
+                if(num & 0x8000)
+                        continue;
+
+                if(reached[num >> 3] & (1 << (num & 7)))
+                        return false;
+                reached[num >> 3] |= 1 << (num & 7);
+
+                stack[top++] = map->nodes[num].children[0];
+                stack[top++] = map->nodes[num].children[1];
+        }
+
+        return true;
+}
+
+static bool Doom_CheckMap(const mapview_t *map)
+{
+        int     i;
+
+        for(i = 0; i < map->numlinedefs; i++)
+        {
+                const dlinedef_t *l = map->linedefs + i;
+
+                if(l->vertices[0] < 0 || l->vertices[0] >= map->numvertices)
+                        return false;
+                if(l->vertices[1] < 0 || l->vertices[1] >= map->numvertices)
+                        return false;
+                if(l->sidedefs[0] < 0 || l->sidedefs[0] >= map->numsidedefs)
+                        return false;
+                if(l->sidedefs[1] < -1 || l->sidedefs[1] >= map->numsidedefs)
+                        return false;
+        }
+
+        for(i = 0; i < map->numsidedefs; i++)
+        {
+                const dsidedef_t *s = map->sidedefs + i;
+
+                if(s->sector < 0 || s->sector >= map->numsectors)
+                        return false;
+        }
+
+        for(i = 0; i < map->numsegs; i++)
+        {
+                const dseg_t *s = map->segs + i;
+
+                if(s->vertices[0] < 0 || s->vertices[0] >= map->numvertices)
+                        return false;
+                if(s->vertices[1] < 0 || s->vertices[1] >= map->numvertices)
+                        return false;
+                if(s->linedef < 0 || s->linedef >= map->numlinedefs)
+                        return false;
+                if(s->side != 0 && s->side != 1)
+                        return false;
+
+                // the seg's side of the linedef has to exist
+                if(map->linedefs[s->linedef].sidedefs[s->side] == -1)
+                        return false;
+        }
+
+        for(i = 0; i < map->numssectors; i++)
+        {
+                const dssector_t *s = map->ssectors + i;
+
+                if(s->startseg < 0 || s->numsegs < 0 || s->startseg + s->numsegs > map->numsegs)
+                        return false;
+        }
+
+        // a map without nodes is a single subsector
+        if(!map->numnodes)
+                return map->numssectors == 1;
+
+        // node numbers are 15 bits, the top bit marks a subsector
+        if(map->numnodes > 0x8000)
+                return false;
+
+        for(i = 0; i < map->numnodes; i++)
+        {
+                for(int j = 0; j < 2; j++)
+                {
+                        unsigned short child = (unsigned short)map->nodes[i].children[j];
+
+                        if(child & 0x8000)
+                        {
+                                if((child & 0x7fff) >= map->numssectors)
+                                        return false;
+                        }
+                        else if(child >= map->numnodes)
+                                return false;
+                }
+        }
+
+        return Doom_CheckNodeTree(map);
+}
+
+int Doom_LoadMap(const char *mapname, mapview_t *map)
+{
+        int             baselump;
+        int             lumps[NUM_MAP_LUMPS];
+        const void      *data[NUM_MAP_LUMPS];
+        int             sizes[NUM_MAP_LUMPS];
+        int             next;
+        int             i;
+
+        memset(map, 0, sizeof(mapview_t));
+        map->baselump = -1;
+
+        // the marker is an empty lump followed by the map lumps in order
+        baselump = Doom_LumpNumFromName(mapname);
+        if(baselump < 0 || Doom_LumpLength(baselump) != 0 || baselump + NUM_REQUIRED_MAP_LUMPS >= resstack.numlumps)
+                return -1;
+
+        int file = resstack.lumps[baselump].file;
+        wadfile_t *wadfile = resstack.files[file];
+
+        // REJECT and BLOCKMAP can be left out, the rest have to be there.
+        // the lumps that are there always follow the marker without gaps
+        next = baselump + THINGS_OFFSET;
+        for(i = 0; i < NUM_MAP_LUMPS; i++)
+        {
+                lumps[i] = -1;
+                data[i] = NULL;
+                sizes[i] = 0;
+
+                if(next < resstack.numlumps
+                        && resstack.lumps[next].file == file
+                        && Lump_NameKey(Doom_LumpName(next)) == Lump_NameKey(maplumpnames[i]))
+                        lumps[i] = next++;
+                else if(i < NUM_REQUIRED_MAP_LUMPS)
+                        return -1;
+        }
+
+        int numlumps = next - (baselump + THINGS_OFFSET);
+
+        if(wadfile->mapping)
+        {
+                // a mapped wad is viewed in place, there's nothing to read or pin
+                for(i = 0; i < NUM_MAP_LUMPS; i++)
+                {
+                        if(lumps[i] != -1)
+                                data[i] = Wad_LumpView(wadfile, resstack.lumps[lumps[i]].lumpnum, sizes + i);
+                }
+        }
+        else
+        {
+                // read the whole map with merged reads then pin it
+                int maplumps[NUM_MAP_LUMPS];
+
+                for(i = 0; i < numlumps; i++)
+                        maplumps[i] = baselump + THINGS_OFFSET + i;
+
+                Doom_CacheLumps(maplumps, numlumps);
+
+                for(i = 0; i < NUM_MAP_LUMPS; i++)
+                {
+                        if(lumps[i] == -1)
+                                continue;
+
+                        sizes[i] = Doom_LumpLength(lumps[i]);
+                        data[i] = Doom_PinLump(lumps[i]);
+
+                        if(sizes[i] && !data[i])
+                        {
+                                while(i--)
+                                {
+                                        if(lumps[i] != -1)
+                                                Doom_UnpinLump(lumps[i]);
+                                }
+                                return -1;
+                        }
+                }
+
+                map->pinned     = true;
+        }
+
+        map->baselump           = baselump;
+        map->numlumps           = numlumps;
+
+        map->things             = (const dthing_t*)data[THINGS_OFFSET - 1];
+        map->numthings          = sizes[THINGS_OFFSET - 1] / sizeof(dthing_t);
+        map->linedefs           = (const dlinedef_t*)data[LINEDEFS_OFFSET - 1];
+        map->numlinedefs        = sizes[LINEDEFS_OFFSET - 1] / sizeof(dlinedef_t);
+        map->sidedefs           = (const dsidedef_t*)data[SIDEDEFS_OFFSET - 1];
+        map->numsidedefs        = sizes[SIDEDEFS_OFFSET - 1] / sizeof(dsidedef_t);
+        map->vertices           = (const dvertex_t*)data[VERTICES_OFFSET - 1];
+        map->numvertices        = sizes[VERTICES_OFFSET - 1] / sizeof(dvertex_t);
+        map->segs               = (const dseg_t*)data[SEGS_OFFSET - 1];
+        map->numsegs            = sizes[SEGS_OFFSET - 1] / sizeof(dseg_t);
+        map->ssectors           = (const dssector_t*)data[SSECTORS_OFFSET - 1];
+        map->numssectors        = sizes[SSECTORS_OFFSET - 1] / sizeof(dssector_t);
+        map->nodes              = (const dnode_t*)data[NODES_OFFSET - 1];
+        map->numnodes           = sizes[NODES_OFFSET - 1] / sizeof(dnode_t);
+        map->sectors            = (const dsector_t*)data[SECTORS_OFFSET - 1];
+        map->numsectors         = sizes[SECTORS_OFFSET - 1] / sizeof(dsector_t);
+        map->reject             = (const unsigned char*)data[REJECT_OFFSET - 1];
+        map->numreject          = sizes[REJECT_OFFSET - 1];
+        map->blockmap           = (const short*)data[BLOCK_OFFSET - 1];
+        map->numblockmap        = sizes[BLOCK_OFFSET - 1] / sizeof(short);
+
+        if(!Doom_CheckMap(map))
+        {
+                Doom_FreeMap(map);
+                return -1;
+        }
+
+        return 0;
+}
+
+void Doom_FreeMap(mapview_t *map)
+{
+        if(map->baselump < 0)
+                return;
+
+        if(map->pinned)
+        {
+                for(int i = 0; i < map->numlumps; i++)
+                        Doom_UnpinLump(map->baselump + THINGS_OFFSET + i);
+        }
+
+        memset(map, 0, sizeof(mapview_t));
+        map->baselump = -1;
+}
+
+// bsp traversal
+
+// which side of the node's partition line the point is on, 0 for the
+// front (right) side, 1 for the back, the same test as R_PointOnSide
+static int Node_PointOnSide(const dnode_t *node, const float *point)
+{
+        float dx = point[0] - node->xy[0];
+        float dy = point[1] - node->xy[1];
+
+        float left      = node->dxdy[1] * dx;
+        float right     = dy * node->dxdy[0];
+
+        return right < left ? 0 : 1;
+}
+
+bool Doom_WalkBSP(const mapview_t *map, const float *viewpoint, bspvisitfunc_t callback, void *userdata)
+{
+        // every node is reached once at most (Doom_LoadMap checks it) so
+        // the stack never holds more than one entry per node plus one
+        unsigned short  stack[0x8000 + 1];
+        int             top = 0;
+
+        // a map without nodes is a single subsector
+        if(!map->numnodes)
+                return callback(map, 0, userdata);
+
+        stack[top++] = map->numnodes - 1;
+
+        while(top)
+        {
+                unsigned short num = stack[--top];
+
+                if(num & 0x8000)
+                {
+                        if(!callback(map, num & 0x7fff, userdata))
+                                return false;
+                        continue;
+                }
+
+                const dnode_t *node = map->nodes + num;
+
+                // push the far side first so the near side is visited first
+                int side = viewpoint ? Node_PointOnSide(node, viewpoint) : 0;
+
+                stack[top++] = node->children[side ^ 1];
+                stack[top++] = node->children[side];
+        }
+
+        return true;
+}
@@ -1,8 +1,15 @@
 #ifndef __DOOMLIB_H__
 #define __DOOMLIB_H__
 
+#include <stdint.h>
+
 // wad / lump interface
+// Doom_ReadWadFile adds a wad to the resource stack, the first file is the
+// iwad and pwads after it override earlier lumps. lump names are matched
+// without case, the last lump with a name wins
+int Doom_NumLumps();
 int Doom_LumpLength(int lumpnum);
+const char *Doom_LumpName(int lumpnum);
 int Doom_LumpNumFromName(const char *lumpname);
 void *Doom_LumpFromNum(int lumpnum);
 void *Doom_LumpFromName(const char *lumpname);
@@ -10,12 +17,37 @@ void Doom_ReadWadFile(const char *filename);
 void Doom_IterateLumps(void (*callback)(int lumpnum, char name[8], int size));
 void Doom_CloseAll();
 
+// lump cache
+// lumps are read the first time they are asked for. with a budget set the
+// least recently used lumps are evicted to stay under it, so a pointer from
+// Doom_LumpFromNum is only good until the next lump is loaded. pinned lumps
+// are never evicted. a budget of zero (the default) means no limit.
+// Doom_CacheLumps loads a set of lumps up front with merged reads
+void Doom_CacheLumps(const int *lumpnums, int numlumps);
+void *Doom_PinLump(int lumpnum);
+void Doom_UnpinLump(int lumpnum);
+void Doom_SetCacheBudget(int numbytes);
+int Doom_CachedBytes();
+
+// with no budget, lump data comes from large cache line aligned arena
+// blocks. Doom_ResetArena drops every cached lump (pinned or not) and
+// rewinds the arena so the next map reuses the same memory
+void Doom_ResetArena();
+
 typedef struct wadfile_s wadfile_t;
 
 // open and close wad files
+// Wad_OpenMapped maps the whole file into memory so lumps can be viewed in place
 wadfile_t *Wad_Open(const char *filename);
+wadfile_t *Wad_OpenMapped(const char *filename);
 void Wad_Close(wadfile_t *wadfile);
 
+// write a sidecar index ("<wadfile>.idx") holding the directory and name
+// hash. Wad_Open and Wad_OpenMapped use it instead of reading the directory
+// and building the name hash while the wad's size, inode and modification
+// and change times still match. returns -1 on failure
+int Wad_WriteIndex(wadfile_t *wadfile);
+
 // wad lump info
 int Wad_NumLumps(wadfile_t *wadfile);
 int Wad_LumpSize(wadfile_t *wadfile, int lumpnum);
@@ -24,9 +56,49 @@ const char* Wad_LumpName(wadfile_t *wadfile, int lumpnum);
 int Wad_LumpNumFromName(wadfile_t *wadfile, const char *lumpname);
 
 // read wad data
+// reads use positional i/o and never change the wad file, so any number of
+// threads may call Wad_ReadLump, Wad_LumpView and the lump info functions
+// on one wadfile_t at the same time. Wad_ReadLump returns NULL on a read error
+// (wadthreads, "make check WAD=<wadfile>", tests this)
 void* Wad_ReadLump(wadfile_t *wadfile, int lumpnum);
 void Wad_FreeLump(unsigned char *data);
 
+// reads into buffers owned by the caller. Wad_ReadLumpInto returns the lump
+// size or -1 if the buffer is too small or the read failed. Wad_ReadLumps
+// sorts the reads by file position and merges neighbouring lumps into single
+// reads, each buffer must hold at least Wad_LumpSize bytes. returns -1 if any
+// read failed
+typedef struct
+{
+        int     lumpnum;
+        void    *buffer;
+} wadread_t;
+
+int Wad_ReadLumpInto(wadfile_t *wadfile, int lumpnum, void *buffer, int buffersize);
+int Wad_ReadLumps(wadfile_t *wadfile, wadread_t *reads, int numreads);
+
+// asynchronous reads
+// Wad_PrefetchLumps asks the os to start reading the lumps in the background
+// and returns straight away, lump numbers out of range (like the -1 for a
+// missing lump) are skipped. Wad_ReadLumpAsync queues a read on a pool of
+// i/o threads. with a callback, the callback is run on an i/o thread, owns
+// the data and NULL is returned. without one, a request is returned that must
+// be passed to Wad_WaitLump, which blocks until the data is read and frees
+// the request. Wad_Close waits for any reads still queued or running on the
+// file, so it must not be called from a callback on that file
+typedef struct wadrequest_s wadrequest_t;
+typedef void (*wadreadfunc_t)(wadfile_t *wadfile, int lumpnum, void *data, void *userdata);
+
+void Wad_PrefetchLumps(wadfile_t *wadfile, const int *lumpnums, int numlumps);
+wadrequest_t *Wad_ReadLumpAsync(wadfile_t *wadfile, int lumpnum, wadreadfunc_t callback, void *userdata);
+bool Wad_LumpReady(wadrequest_t *request);
+void *Wad_WaitLump(wadrequest_t *request);
+
+// zero copy access for mapped wad files, returns NULL if the file isn't mapped
+// views are owned by the wad file and stay valid until Wad_Close, they are
+// never passed to Wad_FreeLump
+const void* Wad_LumpView(wadfile_t *wadfile, int lumpnum, int *size);
+
 #define THINGS_OFFSET		1
 #define LINEDEFS_OFFSET		2
 #define	SIDEDEFS_OFFSET		3
@@ -126,4 +198,56 @@ typedef struct
 
 } dnode_t;
 
+// map loading
+// Doom_LoadMap returns typed views of the lumps of a map. views of a mapped
+// wad point straight into the mapping, otherwise the lumps are read and
+// pinned. REJECT and BLOCKMAP are optional, a missing one has a NULL view
+// and a count of 0. every index in the map (linedef vertices and sidedefs,
+// sidedef sectors, seg vertices and linedefs, subsector seg ranges and node
+// children) is checked once here so code walking the map doesn't have to.
+// the nodes can be in any order, but walking down from the root (the last
+// node) must not reach any node twice. returns -1 if the map isn't there
+// or doesn't pass the checks. Doom_FreeMap releases the views
+typedef struct
+{
+	int			baselump;
+	int			numlumps;	// lumps after the marker
+	bool			pinned;
+
+	const dthing_t		*things;
+	int			numthings;
+	const dlinedef_t	*linedefs;
+	int			numlinedefs;
+	const dsidedef_t	*sidedefs;
+	int			numsidedefs;
+	const dvertex_t		*vertices;
+	int			numvertices;
+	const dseg_t		*segs;
+	int			numsegs;
+	const dssector_t	*ssectors;
+	int			numssectors;
+	const dnode_t		*nodes;
+	int			numnodes;
+	const dsector_t		*sectors;
+	int			numsectors;
+	const unsigned char	*reject;
+	int			numreject;
+	const short		*blockmap;
+	int			numblockmap;
+
+} mapview_t;
+
+int Doom_LoadMap(const char *mapname, mapview_t *map);
+void Doom_FreeMap(mapview_t *map);
+
+// bsp traversal
+// Doom_WalkBSP calls the callback for every subsector of a loaded map,
+// walking the nodes with an explicit stack. with a viewpoint (map x and y)
+// subsectors are visited front to back from it, without one (NULL) child
+// 0 is visited before child 1. the callback returns false to stop the
+// walk, in which case Doom_WalkBSP returns false too
+typedef bool (*bspvisitfunc_t)(const mapview_t *map, int ssectornum, void *userdata);
+
+bool Doom_WalkBSP(const mapview_t *map, const float *viewpoint, bspvisitfunc_t callback, void *userdata);
+
 #endif
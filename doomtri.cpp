@@ -1,9 +1,13 @@
-#include "doomlib.h"
+#include "trimodel.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
-#include <math.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <unistd.h>
+#include <pthread.h>
 
 static void Error(const char *format, ...)
 {
@@ -23,470 +27,224 @@ static void Error(const char *format, ...)
         exit(1);
 }
 
+// command line options
+static bool	writemodels = true;
+static int	vertexformat = MDL_VERTEX_PACKED;
+
 // =============================================================
-// triangle code
+// map building
 
-typedef struct trivert_s
+// filename can be NULL to build the model without writing it
+static void BuildMap(const mapview_t *level, const char *mapname, const char *filename)
 {
-	float	xyz[3];
-	float	lightlevel;
+	trimodel_t	model;
 
-} trivert_t;
+	BuildMapModel(level, &model);
 
-static int	numvertices;
-static int	numindicies;
-static FILE	*binfile;
-
-static void OpenTriangleModelFile(const char *filename)
-{
-	binfile = fopen(filename, "wb");
-	if(!binfile)
+	if(filename)
 	{
-		Error("Couldn't open model file\n");
+		if(WriteTriangleModelFile(&model, filename, vertexformat) == -1)
+			Error("Couldn't write model file \"%s\"\n", filename);
 	}
+	else
+	{
+		int numvertices = 0;
+		int numindicies = 0;
 
-	// reserve space for the vertex count
-	fseek(binfile, 4 , SEEK_SET);
-}
+		for(int i = 0; i < model.numsurfaces; i++)
+		{
+			numvertices += model.surfaces[i].mesh.numvertices;
+			numindicies += model.surfaces[i].mesh.numindicies;
+		}
 
-static void CloseTriangleModelFile()
-{
-	// emit the indicies
-	numindicies = numvertices;
-	fwrite(&numindicies, sizeof(int), 1, binfile);
-	for(int i = 0; i < numindicies; i++)
-	{
-		fwrite(&i, sizeof(int), 1, binfile);
+		printf("%s: %i nodes, %i chunks, %i surfaces, %i vertices, %i indicies\n", mapname, model.numnodes, model.numchunks, model.numsurfaces, numvertices, numindicies);
 	}
 
-	// write the actual vertex count
-	fseek(binfile, 0 , SEEK_SET);
-	fwrite(&numvertices, sizeof(int), 1, binfile);
-
-	fclose(binfile);
+	FreeModel(&model);
 }
 
-static void EmitBinaryTriangle(trivert_t v0, trivert_t v1, trivert_t v2)
+// ExMy or MAPxx
+static bool IsMapName(const char *name)
 {
-	// fixme: replace with EmitFloat?
-	fwrite(&v0, sizeof(trivert_t), 1, binfile);
-	fwrite(&v1, sizeof(trivert_t), 1, binfile);
-	fwrite(&v2, sizeof(trivert_t), 1, binfile);
-	fflush(binfile);
-
-	numvertices += 3;
-}
+	if(name[0] == 'E' && isdigit(name[1]) && name[2] == 'M' && isdigit(name[3]) && !name[4])
+		return true;
 
-// interface to the triangle code
-static void AddTriangle(trivert_t v0, trivert_t v1, trivert_t v2)
-{
-	//printf("adding triangle:\n");
-	//printf("(%f %f %f)\n", v0.xyz[0], v0.xyz[1], v0.xyz[2]);
-	//printf("(%f %f %f)\n", v1.xyz[0], v1.xyz[1], v1.xyz[2]);
-	//printf("(%f %f %f)\n", v2.xyz[0], v2.xyz[1], v2.xyz[2]);
+	if(!strncmp(name, "MAP", 3) && isdigit(name[3]) && isdigit(name[4]) && !name[5])
+		return true;
 
-	EmitBinaryTriangle(v0, v1, v2);
+	return false;
 }
 
-// =============================================================
-// geometry generation code
-
-typedef struct leveldata_s
+// batch mode, the map names are found up front and a pool of threads
+// works through them, each thread taking the next map as soon as it's
+// done with the last. the doom lump code isn't thread safe so maps are
+// loaded and freed under a lock, building needs no lock since the maps are
+// read only and each thread has its own tribuild_t. a mapped wad is viewed
+// in place, otherwise the lumps are read into the lump arena, which is
+// reset whenever no map is loaded so a whole megawad doesn't pile up there
+typedef struct maptask_s
 {
-	dvertex_t	*vertices;
-	dlinedef_t	*linedefs;
-	dsidedef_t	*sidedefs;
-	dsector_t	*sectors;
-	dseg_t		*segs;
-	dssector_t	*ssectors;
-	dnode_t		*nodes;
+	char		name[9];
+	bool		built;
 
-	int		numnodes;
+} maptask_t;
 
-} leveldata_t;
+static maptask_t	*maptasks;
+static int		nummaptasks;
+static int		nextmaptask;
 
-// fixme:
-static leveldata_t	leveldatastatic;
-static leveldata_t	*leveldata = &leveldatastatic;
+static pthread_mutex_t	maplock = PTHREAD_MUTEX_INITIALIZER;
+static int		numloadedmaps;
 
-static float Fixed16ToFloat(int fixed)
+static void *BuildMapsThread(void *arg)
 {
-	return (float)fixed;
-}
+	(void)arg;
 
-static void SidedefsFromLinedef(dsidedef_t *s[2], dlinedef_t *l)
-{
-	for(int i = 0; i < 2; i++)
+	for(;;)
 	{
-		if(l->sidedefs[i] == -1)
+		int i = __sync_fetch_and_add(&nextmaptask, 1);
+		if(i >= nummaptasks)
+			break;
+
+		maptask_t *task = maptasks + i;
+		mapview_t level;
+
+		pthread_mutex_lock(&maplock);
+		int loaded = Doom_LoadMap(task->name, &level);
+		if(loaded != -1)
+			numloadedmaps++;
+		pthread_mutex_unlock(&maplock);
+
+		if(loaded == -1)
 		{
-			s[i]	= NULL;
+			fprintf(stderr, "Skipping map \"%s\", it's missing lumps or is broken\n", task->name);
 			continue;
 		}
 
-		s[i] = leveldata->sidedefs + l->sidedefs[i];
-	}
-}
+		char filename[16];
+		snprintf(filename, sizeof(filename), "%s.mdl", task->name);
 
-static dnode_t *NodeFromNum(int num)
-{
-	return leveldata->nodes + num;
-}
+		BuildMap(&level, task->name, writemodels ? filename : NULL);
+		task->built = true;
 
-static dsector_t *SectorFromNum(int num)
-{
-	return leveldata->sectors + num;
-}
+		pthread_mutex_lock(&maplock);
+		Doom_FreeMap(&level);
 
-static void GetLevelData(leveldata_t *d, const char *mapname)
-{
-	int baselump = Doom_LumpNumFromName(mapname);
-
-	if(baselump < 0 || Doom_LumpLength(baselump) != 0)
-	{
-		Error("Map \"%s\" not found\n", mapname);
-		exit(-1);
+		// only read lumps are in the arena, views of a mapped wad aren't
+		if(!--numloadedmaps && Doom_CachedBytes())
+			Doom_ResetArena();
+		pthread_mutex_unlock(&maplock);
 	}
 
-	d->vertices	= (dvertex_t*)Doom_LumpFromNum(baselump + VERTICES_OFFSET);
-	d->linedefs	= (dlinedef_t*)Doom_LumpFromNum(baselump + LINEDEFS_OFFSET);
-	d->sidedefs	= (dsidedef_t*)Doom_LumpFromNum(baselump + SIDEDEFS_OFFSET);
-	d->sectors	= (dsector_t*)Doom_LumpFromNum(baselump + SECTORS_OFFSET);
-	d->segs		= (dseg_t*)Doom_LumpFromNum(baselump + SEGS_OFFSET);
-	d->ssectors	= (dssector_t*)Doom_LumpFromNum(baselump + SSECTORS_OFFSET);
-	d->nodes	= (dnode_t*)Doom_LumpFromNum(baselump + NODES_OFFSET);
-	
-	d->numnodes	= Doom_LumpLength(baselump + NODES_OFFSET) / sizeof(dnode_t);
+	return NULL;
 }
 
-static int SegSortFunc(const void *a, const void *b)
+static void BuildAllMaps(int numthreads)
 {
-	dseg_t	*sa = *(dseg_t**)a;
-	dseg_t	*sb = *(dseg_t**)b;
-
-
-
-	int result = sb->vertices[0] - sa->vertices[1];
+	int i, nummaps = 0;
 
-	//if(result < 0)
-	//	result = -result;
+	maptasks = (maptask_t*)malloc(sizeof(maptask_t) * Doom_NumLumps());
+	nummaptasks = 0;
+	nextmaptask = 0;
 
-	//return sa->vertices[0] - sb->vertices[0];
-
-	return result;
-}
-
-static void SortSegs(dssector_t *ss)
-{
-	dseg_t *segarray[2048];
-
-	dseg_t *seg	= leveldata->segs + ss->startseg;
-	for(int i = 0; i < ss->numsegs; i++, seg++)
+	// find the map markers, a pwad map replaces the one with the same name
+	for(i = 0; i < Doom_NumLumps(); i++)
 	{
-		segarray[i] = seg;
-	}
+		maptask_t *task = maptasks + nummaptasks;
 
-	qsort(segarray, ss->numsegs, sizeof(dseg_t*), SegSortFunc);
+		memset(task, 0, sizeof(*task));
+		strncpy(task->name, Doom_LumpName(i), 8);
 
-	for(int i = 0; i < ss->numsegs; i++)
-	{
-		seg = segarray[i];
-		printf( "%i, (%i %i), start=(%f, %f), end=(%f, %f), offset=%i\n",
-			i,
-			seg->vertices[0],
-			seg->vertices[1],
-			Fixed16ToFloat(leveldata->vertices[seg->vertices[0]].xy[0]),
-			Fixed16ToFloat(leveldata->vertices[seg->vertices[0]].xy[1]),
-			Fixed16ToFloat(leveldata->vertices[seg->vertices[1]].xy[0]),
-			Fixed16ToFloat(leveldata->vertices[seg->vertices[1]].xy[1]),
-			seg->offset);
+		if(IsMapName(task->name) && Doom_LumpNumFromName(task->name) == i)
+			nummaptasks++;
 	}
-}
-
 
+	if(numthreads > nummaptasks)
+		numthreads = nummaptasks;
 
-//void EmitMiddleWallGeometry()
-//void EmitUpperAndLowerWallGeometry()
-//void EmitFloorAndCeilingGeometry()
+	pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * (numthreads ? numthreads : 1));
+	for(i = 0; i < numthreads; i++)
+		pthread_create(threads + i, NULL, BuildMapsThread, NULL);
+	for(i = 0; i < numthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
 
-// if single sided, emit middle polygon
-// if double sided emit middle, lower and upper polygon
-static void SegVertexData(float xy[2][2], dseg_t *seg)
-{
-	// get the vertex data for the seg
-	if(seg->side == 0)
+	for(i = 0; i < nummaptasks; i++)
 	{
-		xy[0][0] = Fixed16ToFloat(leveldata->vertices[seg->vertices[0]].xy[0]);
-		xy[0][1] = Fixed16ToFloat(leveldata->vertices[seg->vertices[0]].xy[1]);
-		xy[1][0] = Fixed16ToFloat(leveldata->vertices[seg->vertices[1]].xy[0]);
-		xy[1][1] = Fixed16ToFloat(leveldata->vertices[seg->vertices[1]].xy[1]);
-	}
-	else
-	{
-		xy[1][0] = Fixed16ToFloat(leveldata->vertices[seg->vertices[0]].xy[0]);
-		xy[1][1] = Fixed16ToFloat(leveldata->vertices[seg->vertices[0]].xy[1]);
-		xy[0][0] = Fixed16ToFloat(leveldata->vertices[seg->vertices[1]].xy[0]); 
-		xy[0][1] = Fixed16ToFloat(leveldata->vertices[seg->vertices[1]].xy[1]); 
-	}
-
-	float dx, dy;
-	dx = xy[1][0] - xy[0][0];
-	dy = xy[1][1] - xy[0][1];
+		if(!maptasks[i].built)
+			continue;
 
-	// calculate a normal for the linedef
-	float nx, ny;
-	nx = dx / sqrtf((dx * dx) + (dy * dy));
-	ny = dy / sqrtf((dx * dx) + (dy * dy));
+		if(writemodels)
+			printf("%s.mdl\n", maptasks[i].name);
+		nummaps++;
+	}
 
-	//xy[0][0] += (nx * seg->offset);
-	//xy[0][1] += (ny * seg->offset);
+	if(!nummaps)
+		Error("No maps found\n");
 
-	//xy[0][0] += sqrt((seg->offset * seg->offset) - (dy * dy));
-	//xy[0][1] += sqrt((seg->offset * seg->offset) - (dx * dx));
-	//float length = sqrtf((dx * dx) + (dy * dy));
-	//xy[0][0] += dx * (seg->offset / length);
-	//xy[0][1] += dy * (seg->offset / length);
+	free(maptasks);
 }
 
-// fixme: could reverse test
-static void EmitMiddleWallGeometry(dseg_t *seg)
+static void PrintUsage()
 {
-	dlinedef_t *ld		= leveldata->linedefs + seg->linedef;
-	dsidedef_t *sd		= leveldata->sidedefs + ld->sidedefs[seg->side];
-	dsector_t *sector	= leveldata->sectors + sd->sector;
-
-	if(sd->textures[2][0] != '-')
-	{
-		// get the seg vertex data
-		float xy[2][2];
-		SegVertexData(xy, seg);
-		
-		// build the 4 triverts that we need
-		trivert_t	trivert[4];
-
-		trivert[0].xyz[0]	= xy[0][0];
-		trivert[0].xyz[1]	= xy[0][1];
-		trivert[0].xyz[2]	= sector->ceiling;
-		trivert[0].lightlevel	= sector->lightlevel;
-
-		trivert[1].xyz[0]	= xy[0][0];
-		trivert[1].xyz[1]	= xy[0][1];
-		trivert[1].xyz[2]	= sector->floor;
-		trivert[1].lightlevel	= sector->lightlevel;
-
-		trivert[2].xyz[0]	= xy[1][0];
-		trivert[2].xyz[1]	= xy[1][1];
-		trivert[2].xyz[2]	= sector->ceiling;
-		trivert[2].lightlevel	= sector->lightlevel;
-
-		trivert[3].xyz[0]	= xy[1][0];
-		trivert[3].xyz[1]	= xy[1][1];
-		trivert[3].xyz[2]	= sector->floor;
-		trivert[3].lightlevel	= sector->lightlevel;
-
-		// this is the order for a triangle strip
-		//AddTriangle(trivert[0], trivert[1], trivert[2]);
-		//AddTriangle(trivert[1], trivert[2], trivert[3]);
-
-		// triangle soup, counter clockwise wound
-		AddTriangle(trivert[0], trivert[1], trivert[2]);
-		AddTriangle(trivert[3], trivert[2], trivert[1]);
-	}
-
+	printf("doomtri [-n] [--float] <wadfile> <mapname>\n");
+	printf("doomtri -a [-j <threads>] [-n] [--float] <wadfile>\n");
+	printf("  -a, --all      build every map in the wad, writing <mapname>.mdl for each\n");
+	printf("  -j <threads>   number of threads for -a, defaults to one per core\n");
+	printf("  -n, --nowrite  build the meshes in memory but don't write any files\n");
+	printf("  --float        write float vertices instead of packed shorts\n");
 }
 
-static void EmitUpperAndLowerWallGeometry(dseg_t *seg)
+int main(int argc, const char * argv[])
 {
-	dsidedef_t *sd[2];
-	dsector_t *sectors[2];
-
-	// only emit if this is a double sided line
-	dlinedef_t *ld		= leveldata->linedefs + seg->linedef;
+	bool	allmaps = false;
+	int	numthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int	arg;
 
-	if(ld->sidedefs[1] == -1)
-		return;
-
-	if(seg->side == 0)
-	{
-		sd[0]		= leveldata->sidedefs + ld->sidedefs[0];
-		sd[1]		= leveldata->sidedefs + ld->sidedefs[1];
-	}
-	else
+	for(arg = 1; arg < argc && argv[arg][0] == '-'; arg++)
 	{
-		sd[1]		= leveldata->sidedefs + ld->sidedefs[0];
-		sd[0]		= leveldata->sidedefs + ld->sidedefs[1];
+		if(!strcmp(argv[arg], "-a") || !strcmp(argv[arg], "--all"))
+			allmaps = true;
+		else if(!strcmp(argv[arg], "-j") && arg + 1 < argc)
+			numthreads = atoi(argv[++arg]);
+		else if(!strcmp(argv[arg], "-n") || !strcmp(argv[arg], "--nowrite"))
+			writemodels = false;
+		else if(!strcmp(argv[arg], "--float"))
+			vertexformat = MDL_VERTEX_FLOAT;
+		else
+			Error("Unknown option \"%s\"\n", argv[arg]);
 	}
 
-	sectors[0]	= leveldata->sectors + sd[0]->sector;
-	sectors[1]	= leveldata->sectors + sd[1]->sector;
-
-	if((sectors[0]->floor < sectors[1]->floor)) // && sd[0]->textures[1][0] != '-')
+	if(arg >= argc || (!allmaps && arg + 1 >= argc))
 	{
-		// build the 4 triverts that we need
-		trivert_t	trivert[4];
-
-		// get the seg vertex data
-		float xy[2][2];
-		SegVertexData(xy, seg);
-
-		trivert[0].xyz[0]	= xy[0][0];
-		trivert[0].xyz[1]	= xy[0][1];
-		trivert[0].xyz[2]	= sectors[1]->floor;
-		trivert[0].lightlevel	= sectors[0]->lightlevel;
-
-		trivert[1].xyz[0]	= xy[0][0];
-		trivert[1].xyz[1]	= xy[0][1];
-		trivert[1].xyz[2]	= sectors[0]->floor;
-		trivert[1].lightlevel	= sectors[0]->lightlevel;
-
-		trivert[2].xyz[0]	= xy[1][0];
-		trivert[2].xyz[1]	= xy[1][1];
-		trivert[2].xyz[2]	= sectors[1]->floor;
-		trivert[2].lightlevel	= sectors[0]->lightlevel;
-
-		trivert[3].xyz[0]	= xy[1][0];
-		trivert[3].xyz[1]	= xy[1][1];
-		trivert[3].xyz[2]	= sectors[0]->floor;
-		trivert[3].lightlevel	= sectors[0]->lightlevel;
-
-		//AddTriangle(trivert[0], trivert[1], trivert[2]);
-		//AddTriangle(trivert[1], trivert[2], trivert[3]);
-
-		// triangle soup, counter clockwise wound
-		AddTriangle(trivert[0], trivert[1], trivert[2]);
-		AddTriangle(trivert[3], trivert[2], trivert[1]);
+		PrintUsage();
+		exit(0);
 	}
 
-	if((sectors[0]->ceiling > sectors[1]->ceiling)) // && sd[0]->textures[0][0] != '-')
-	{
-		// build the 4 triverts that we need
-		trivert_t	trivert[4];
-
-		// get the seg vertex data
-		float xy[2][2];
-		SegVertexData(xy, seg);
-
-		trivert[0].xyz[0]	= xy[0][0];
-		trivert[0].xyz[1]	= xy[0][1];
-		trivert[0].xyz[2]	= sectors[1]->ceiling;
-		trivert[0].lightlevel	= sectors[0]->lightlevel;
-
-		trivert[1].xyz[0]	= xy[0][0];
-		trivert[1].xyz[1]	= xy[0][1];
-		trivert[1].xyz[2]	= sectors[0]->ceiling;
-		trivert[1].lightlevel	= sectors[0]->lightlevel;
-
-		trivert[2].xyz[0]	= xy[1][0];
-		trivert[2].xyz[1]	= xy[1][1];
-		trivert[2].xyz[2]	= sectors[1]->ceiling;
-		trivert[2].lightlevel	= sectors[0]->lightlevel;
-
-		trivert[3].xyz[0]	= xy[1][0];
-		trivert[3].xyz[1]	= xy[1][1];
-		trivert[3].xyz[2]	= sectors[0]->ceiling;
-		trivert[3].lightlevel	= sectors[0]->lightlevel;
-
-		//AddTriangle(trivert[0], trivert[1], trivert[2]);
-		//AddTriangle(trivert[1], trivert[2], trivert[3]);
-
-		// triangle soup, counter clockwise wound
-		AddTriangle(trivert[0], trivert[1], trivert[2]);
-		AddTriangle(trivert[3], trivert[2], trivert[1]);
-	}
-}
+	if(numthreads < 1)
+		numthreads = 1;
 
-static void ProcessSubSector(dssector_t *ss)
-{
-	int i;
+	Doom_ReadWadFile(argv[arg]);
 
-#if 0
+	if(allmaps)
 	{
-		printf("ssector: ------------------------------------\n");
-		dseg_t *seg	= leveldata->segs + ss->startseg;
-		for(i = 0; i < ss->numsegs; i++, seg++)
-		{
-			dlinedef_t *ld = leveldata->linedefs + seg->linedef;
-			printf("seg: %i: vertices=(%i %i) levertices(%i %i) offset=%i\n",
-					i,
-					seg->vertices[0],
-					seg->vertices[1],
-					ld->vertices[0],
-					ld->vertices[1],
-					seg->offset);
-		}
+		BuildAllMaps(numthreads);
 	}
-#endif	
-
+	else
 	{
-		dseg_t *seg	= leveldata->segs + ss->startseg;
-		for(i = 0; i < ss->numsegs; i++, seg++)
-		{
-			EmitMiddleWallGeometry(seg);
-		}
-	}
+		mapview_t level;
 
-	{
-		dseg_t *seg	= leveldata->segs + ss->startseg;
-		for(i = 0; i < ss->numsegs; i++, seg++)
+		if(Doom_LoadMap(argv[arg + 1], &level) == -1)
 		{
-			EmitUpperAndLowerWallGeometry(seg);
+			Error("Map \"%s\" not found\n", argv[arg + 1]);
 		}
-	}
-
-}
-
-static void WalkNodesRecursive(short nodenum)
-{
-	if(nodenum & 0x8000)
-	{
-		//SortSegs(leveldata->ssectors + (nodenum & 0x7fff));
 
-		// this is a subsector
-		ProcessSubSector(leveldata->ssectors + (nodenum & 0x7fff));
+		BuildMap(&level, argv[arg + 1], writemodels ? "tris.mdl" : NULL);
 
-		return;
-	}
-
-	dnode_t	*n = leveldata->nodes + nodenum;
-
-	WalkNodesRecursive(n->children[0]);
-	WalkNodesRecursive(n->children[1]);
-}
-
-static void WalkNodes()
-{
-	//WalkNodesRecursive(0);
-	
-	WalkNodesRecursive(leveldata->numnodes - 1);
-}
-
-static void PrintUsage()
-{
-	printf("dumptri <wadfile> <mapname>\n");
-}
-
-int main(int argc, const char * argv[])
-{
-	if(argc == 1)
-	{
-		PrintUsage();
-		exit(0);
-	}
-
-	Doom_ReadWadFile(argv[1]);
-
-	GetLevelData(leveldata, argv[2]);
-
-	{
-		OpenTriangleModelFile("tris.mdl");
-		
-		WalkNodes();
-
-		CloseTriangleModelFile();
+		Doom_FreeMap(&level);
 	}
 
 	Doom_CloseAll();
 	
 	return 0;
 }
-
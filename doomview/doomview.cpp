@@ -3,10 +3,22 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stddef.h>
 
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#endif
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
 #ifdef WIN32
 //#include <windows.h>
 #winclude "freeglut/include/GL/freeglut.h"
@@ -14,13 +26,23 @@
 #include <GL/freeglut.h>
 #endif
 
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "../mdlfile.h"
+
 #define PI 3.14159265358979323846f
 
 static char*	filename;
 
-static int oldtime;
-static int realtime;
-static int framenum;
+static long long oldtime;
+static long long tickaccum;	// time not yet simulated
+static long long nextdrawtime;
+static int maxfps;		// -maxfps n caps the redraw rate, 0 doesn't
+static bool redraw;
+static bool loading;		// surfaces are still arriving from the load thread
 
 // Input
 typedef struct input_s
@@ -58,12 +80,69 @@ unsigned int Sys_Milliseconds (void)
 	return curtime;
 }
 
+long long Sys_Microseconds(void)
+{
+	struct timeval tp;
+	static time_t secbase;
+
+	gettimeofday(&tp, NULL);
+
+	if (!secbase)
+	{
+		secbase = tp.tv_sec;
+	}
+
+	return (long long)(tp.tv_sec - secbase) * 1000000 + tp.tv_usec;
+}
+
+void Sys_Sleep(unsigned int msecs)
+{
+	usleep(msecs * 1000);
+}
+#endif
+
+#if !defined(__APPLE__) && !defined(WIN32)
+// posix, the monotonic clock never jumps when the wall clock is changed
+long long Sys_Microseconds(void)
+{
+	struct timespec tp;
+	static time_t secbase;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	if (!secbase)
+	{
+		secbase = tp.tv_sec;
+	}
+
+	return (long long)(tp.tv_sec - secbase) * 1000000 + tp.tv_nsec / 1000;
+}
+
+unsigned int Sys_Milliseconds(void)
+{
+	return (unsigned int)(Sys_Microseconds() / 1000);
+}
+
 void Sys_Sleep(unsigned int msecs)
 {
 	usleep(msecs * 1000);
 }
 #endif
 
+#ifndef WIN32
+void Sys_SleepMicroseconds(long long usecs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = usecs / 1000000;
+	ts.tv_nsec = (usecs % 1000000) * 1000;
+
+	// a signal cuts the sleep short, carry on with what's left
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+#endif
+
 #ifdef WIN32
 unsigned int Sys_Milliseconds(void)
 {
@@ -81,45 +160,178 @@ unsigned int Sys_Milliseconds(void)
 	return curtime;
 }
 
+long long Sys_Microseconds(void)
+{
+	static LARGE_INTEGER frequency;
+	static LARGE_INTEGER basetime;
+	LARGE_INTEGER curtime;
+
+	if(!frequency.QuadPart)
+	{
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&basetime);
+	}
+
+	QueryPerformanceCounter(&curtime);
+
+	return (curtime.QuadPart - basetime.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
 void Sys_Sleep(unsigned int msecs)
 {
 	Sleep(msecs);
 }
+
+void Sys_SleepMicroseconds(long long usecs)
+{
+	Sleep((DWORD)((usecs + 999) / 1000));
+}
 #endif
 
 // ==============================================
 // memory allocation
 
-#define MEM_ALLOC_SIZE	32 * 1024 * 1024
+// a stack of blocks, allocations bump through the newest block and a new
+// one is added when it runs out. Mem_FreeStack releases everything at
+// once, and merges the blocks into one big enough for all of it so a model
+// that is loaded again fits in a single block
+//
+// blocks are whole multiples of MEM_BLOCK_SIZE, the size of an x86 huge
+// page, and are aligned to it so linux can back them with huge pages
+
+#define MEM_BLOCK_SIZE	(2 * 1024 * 1024)
+#define MEM_ALIGN	16
+
+typedef struct memblock_s
+{
+	struct memblock_s	*next;		// the older blocks
+	size_t			size;
+	size_t			used;
+
+} memblock_t;
 
 typedef struct memstack_s
 {
-	unsigned char mem[MEM_ALLOC_SIZE];
-	int allocated;
+	memblock_t	*blocks;		// newest first
+	int		numblocks;
+	size_t		reserved;		// all the blocks together
+	size_t		allocated;		// handed out since the last free
+	size_t		peak;
 
 } memstack_t;
 
-static memstack_t memstack;
+// two stacks so a model can be reloaded into one while the other is drawn
+static memstack_t memstacks[2];
+static memstack_t *memstack = memstacks;
+
+// the header takes the start of the block so the first allocation is
+// still MEM_ALIGN aligned
+#define MEM_HEADER_SIZE	((sizeof(memblock_t) + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1))
 
-void *Mem_Alloc(int numbytes)
+static void Mem_NewBlock(size_t numbytes)
 {
-	unsigned char *mem;
-	
-	if(memstack.allocated + numbytes > MEM_ALLOC_SIZE)
+	// grow by at least half of what's there so big loads take few blocks
+	size_t size = numbytes + MEM_HEADER_SIZE;
+	if(size < memstack->reserved / 2)
+		size = memstack->reserved / 2;
+	size = (size + MEM_BLOCK_SIZE - 1) & ~(size_t)(MEM_BLOCK_SIZE - 1);
+
+	void *mem = NULL;
+#ifdef WIN32
+	mem = _aligned_malloc(size, MEM_BLOCK_SIZE);
+#else
+	if(posix_memalign(&mem, MEM_BLOCK_SIZE, size))
+		mem = NULL;
+#endif
+#ifdef __linux__
+	if(mem)
+		madvise(mem, size, MADV_HUGEPAGE);
+#endif
+
+	if(!mem)
 	{
-		printf("Error: Mem: no free space available\n");
+		printf("Error: Mem: couldn't allocate a %i KB block\n", (int)(size / 1024));
 		abort();
 	}
 
-	mem = memstack.mem + memstack.allocated;
-	memstack.allocated += numbytes;
+	memblock_t *block = (memblock_t*)mem;
+	block->next = memstack->blocks;
+	block->size = size;
+	block->used = MEM_HEADER_SIZE;
+
+	memstack->blocks = block;
+	memstack->numblocks++;
+	memstack->reserved += size;
+}
+
+void *Mem_Alloc(size_t numbytes)
+{
+	unsigned char *mem;
+
+	numbytes = (numbytes + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1);
+
+	memblock_t *block = memstack->blocks;
+	if(!block || block->size - block->used < numbytes)
+	{
+		Mem_NewBlock(numbytes);
+		block = memstack->blocks;
+	}
+
+	mem = (unsigned char*)block + block->used;
+	block->used += numbytes;
+
+	memstack->allocated += numbytes;
+	if(memstack->allocated > memstack->peak)
+		memstack->peak = memstack->allocated;
 
 	return mem;
 }
 
 void Mem_FreeStack()
 {
-	memstack.allocated = 0;
+	memblock_t *block = memstack->blocks;
+
+	// one block is kept and reused as it is
+	if(memstack->numblocks > 1)
+	{
+		size_t reserved = memstack->reserved;
+
+		while(block)
+		{
+			memblock_t *next = block->next;
+#ifdef WIN32
+			_aligned_free(block);
+#else
+			free(block);
+#endif
+			block = next;
+		}
+
+		memstack->blocks = NULL;
+		memstack->numblocks = 0;
+		memstack->reserved = 0;
+
+		Mem_NewBlock(reserved - MEM_HEADER_SIZE);
+		block = memstack->blocks;
+	}
+
+	if(block)
+		block->used = MEM_HEADER_SIZE;
+
+	memstack->allocated = 0;
+}
+
+// switch to the other stack, the current one is left as it is
+void Mem_SwapStacks()
+{
+	memstack = memstack == memstacks ? memstacks + 1 : memstacks;
+}
+
+void Mem_PrintUsage()
+{
+	fprintf(stdout, "memory: %i KB used, %i KB peak, %i KB in %i blocks\n",
+		(int)(memstack->allocated / 1024), (int)(memstack->peak / 1024),
+		(int)(memstack->reserved / 1024), memstack->numblocks);
 }
 
 // ==============================================
@@ -216,23 +428,77 @@ typedef unsigned int modelindex_t;
 
 typedef struct trisurf_s
 {
+	int				sector;
+	char			texture[9];
+
 	int 			numvertices;
 	modelvert_t		*vertices;
 
 	int				numindicies;
 	modelindex_t	*indicies;
 
+	// gl buffer objects holding the vertices and indicies, 0 when the
+	// surface is drawn from client memory
+	unsigned int	vertexbuffer;
+	unsigned int	indexbuffer;
+
+	// of the vertices and indicies, a reload keeps the buffers of
+	// surfaces that hash and compare the same
+	unsigned int	hash;
+
 } trisurf_t;
 
+
 static int numtrisurfs;
-static trisurf_t trisurfs[16384];
+static int maxtrisurfs;
+static trisurf_t *trisurfs;
 
-static trisurf_t *AllocSurface()
+// a bsp subtree's worth of surfaces, in doom coordinates
+typedef struct modelchunk_s
+{
+	float			mins[3];
+	float			maxs[3];
+	int				firstsurface;
+	int				numsurfaces;
+
+} modelchunk_t;
+
+// children are node numbers, or -1 - the chunk number for chunks. the
+// root is the last node, with no nodes every chunk is drawn on its own
+typedef struct modelnode_s
+{
+	float			mins[3];
+	float			maxs[3];
+	int				children[2];
+
+} modelnode_t;
+
+static int nummodelchunks;
+static modelchunk_t *modelchunks;
+static int nummodelnodes;
+static modelnode_t *modelnodes;
+
+static trisurf_t *AllocSurface(trisurf_t **surfaces, int *numsurfaces, int *maxsurfaces)
 {
 	trisurf_t *trisurf;
 
-	trisurf = trisurfs + numtrisurfs;
-	numtrisurfs++;
+	// the array is kept between loads and only ever grows
+	if(*numsurfaces == *maxsurfaces)
+	{
+		*maxsurfaces = *maxsurfaces ? *maxsurfaces * 2 : 1024;
+
+		*surfaces = (trisurf_t*)realloc(*surfaces, *maxsurfaces * sizeof(trisurf_t));
+		if(!*surfaces)
+		{
+			Error("Couldn't allocate %i surfaces\n", *maxsurfaces);
+		}
+	}
+
+	trisurf = *surfaces + *numsurfaces;
+	(*numsurfaces)++;
+
+	memset(trisurf, 0, sizeof(*trisurf));
+	trisurf->sector = -1;
 
 	return trisurf;
 }
@@ -240,322 +506,1079 @@ static trisurf_t *AllocSurface()
 static void FreeAllSurfaces()
 {
 	numtrisurfs = 0;
+	nummodelchunks = 0;
+	nummodelnodes = 0;
 }
 
-static int ReadInt(FILE *fp)
+// where the reader sends what it reads, straight into the model or through
+// the load queue to the main thread
+typedef struct modelsink_s
 {
-	int data;
-	fread(&data, sizeof(int), 1, fp);
+	void	(*surface)(const trisurf_t *trisurf);
+	void	(*tree)(int numchunks, modelchunk_t *chunks, int numnodes, modelnode_t *nodes);
 
-	return data;
-}
+} modelsink_t;
 
-static unsigned int ReadUnsignedInt(FILE *fp)
+static void AddSurface(const trisurf_t *trisurf)
 {
-	unsigned int data;
-	fread(&data, sizeof(unsigned int), 1, fp);
-
-	return data;
+	*AllocSurface(&trisurfs, &numtrisurfs, &maxtrisurfs) = *trisurf;
 }
 
-static float ReadFloat(FILE *fp)
+static void SetTree(int numchunks, modelchunk_t *chunks, int numnodes, modelnode_t *nodes)
 {
-	float data;
-	fread(&data, sizeof(float), 1, fp);
-
-	return data;
+	nummodelchunks	= numchunks;
+	modelchunks	= chunks;
+	nummodelnodes	= numnodes;
+	modelnodes	= nodes;
 }
 
-static void ReadSurfaces()
-{
-	int i, j;
-
-	// free all trisurfs currently allocated
-	FreeAllSurfaces();
-
-	// free any allocated stack memory
-	Mem_FreeStack();
-
-	int numtriangles = 0;
-	int numvertices = 0;
+static const modelsink_t modelsink = { AddSurface, SetTree };
 
+// the model is read into memory with a single fread and the vertices and
+// indicies are converted out of that with plain loops over whole arrays,
+// which the compiler can vectorise
+//
+// the reader doesn't exit on a bad file, it warns and returns false so a
+// reload that fails can keep the model that's already there
+static unsigned char *LoadFile(const char *filename, int *size)
+{
 	FILE *fp = fopen(filename, "rb");
 	if(!fp)
 	{
-		Error("Couldn't open file %s\n", filename);
+		Warning("Couldn't open file %s\n", filename);
+		return NULL;
 	}
 
-	int numsurfaces = 1;
-	for(i = 0; i < numsurfaces; i++)
+	fseek(fp, 0, SEEK_END);
+	long length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	unsigned char *data = (unsigned char*)malloc(length > 0 ? length : 1);
+	if(!data || length < 0)
 	{
-		trisurf_t *trisurf = AllocSurface();
-		
-		trisurf->numvertices = ReadInt(fp);
-		trisurf->vertices = (modelvert_t*)Mem_Alloc(trisurf->numvertices * sizeof(modelvert_t));
-		for(j = 0; j < trisurf->numvertices; j++)
-		{
-			trisurf->vertices[j].xyz[0] = ReadFloat(fp);
-			trisurf->vertices[j].xyz[1] = ReadFloat(fp);
-			trisurf->vertices[j].xyz[2] = ReadFloat(fp);
-
-			float lightlevel = ReadFloat(fp) / 256.0f;
-			trisurf->vertices[j].lightlevel[0] = lightlevel;
-			trisurf->vertices[j].lightlevel[1] = lightlevel;
-			trisurf->vertices[j].lightlevel[2] = lightlevel;
-		}
+		Warning("Couldn't allocate %li bytes for %s\n", length, filename);
+		free(data);
+		fclose(fp);
+		return NULL;
+	}
+
+	if(fread(data, 1, length, fp) != (size_t)length)
+	{
+		Warning("Couldn't read %s\n", filename);
+		free(data);
+		fclose(fp);
+		return NULL;
+	}
 
-		numvertices += trisurf->numvertices;
+	fclose(fp);
 
-		trisurf->numindicies = ReadInt(fp);
-		trisurf->indicies = (modelindex_t*)Mem_Alloc(trisurf->numindicies * sizeof(modelindex_t));
-		for(j = 0; j < trisurf->numindicies; j++)
-		{
-			trisurf->indicies[j] = ReadInt(fp);
-		}
+	*size = (int)length;
+	return data;
+}
 
-		numtriangles += (trisurf->numindicies / 3);
+// returns the data at ofs, or NULL if len bytes from there aren't all in
+// the file
+static const unsigned char *FileData(const unsigned char *data, int size, int ofs, int len)
+{
+	if(ofs < 0 || len < 0 || ofs > size || len > size - ofs)
+	{
+		Warning("%s is truncated or has a bad offset\n", filename);
+		return NULL;
 	}
 
-	fprintf(stdout, "surface count: %d\n", numsurfaces);
-	fprintf(stdout, "vertex count: %d\n", numvertices);
-	fprintf(stdout, "triangle count: %d\n", numtriangles);
+	return data + ofs;
 }
 
-//==============================================
-// simulation code
+// the raw light level goes in lightlevel[0] until ScaleLightLevels
+static void CopyFloatVertices(modelvert_t *out, const dmdlvertex_t *in, int count)
+{
+	for(int i = 0; i < count; i++)
+	{
+		out[i].xyz[0]		= in[i].xyz[0];
+		out[i].xyz[1]		= in[i].xyz[1];
+		out[i].xyz[2]		= in[i].xyz[2];
+		out[i].lightlevel[0]	= in[i].lightlevel;
+	}
+}
 
-static float viewangles[2];
-static float viewpos[3];
-static float viewvectors[3][3];
+static void CopyPackedVertices(modelvert_t *out, const dmdlpackedvertex_t *in, int count)
+{
+	for(int i = 0; i < count; i++)
+	{
+		out[i].xyz[0]		= in[i].xyz[0];
+		out[i].xyz[1]		= in[i].xyz[1];
+		out[i].xyz[2]		= in[i].xyz[2];
+		out[i].lightlevel[0]	= in[i].lightlevel;
+	}
+}
 
-typedef struct tickcmd_s
+// light levels are 0-255 in the file, gl wants 0-1 in each of r, g and b
+static void ScaleLightLevels(modelvert_t *vertices, int count)
 {
-	float	forwardmove;
-	float	sidemove;
-	float	anglemove[2];
+	const float scale = 1.0f / 256.0f;
 
-} tickcmd_t;
+	for(int i = 0; i < count; i++)
+	{
+		float lightlevel = vertices[i].lightlevel[0] * scale;
 
-static tickcmd_t gcmd;
+		vertices[i].lightlevel[0] = lightlevel;
+		vertices[i].lightlevel[1] = lightlevel;
+		vertices[i].lightlevel[2] = lightlevel;
+	}
+}
 
-static void VectorsFromSphericalAngles(float vectors[3][3], float angles[2])
+static void ReadVertices(trisurf_t *trisurf, const unsigned char *data, int vertexformat)
 {
-	float cx, sx, cy, sy, cz, sz;
-
-	cx = 1.0f;
-	sx = 0.0f;
-	cy = cosf(angles[0]);
-	sy = sinf(angles[0]);
-	cz = cosf(angles[1]);
-	sz = sinf(angles[1]);
-
-	vectors[0][0] = cy * cz;
-	vectors[0][1] = sz;
-	vectors[0][2] = -sy * cz;
+	trisurf->vertices = (modelvert_t*)Mem_Alloc(trisurf->numvertices * sizeof(modelvert_t));
 
-	vectors[1][0] = (-cx * cy * sz) + (sx * sy);
-	vectors[1][1] = cx * cz;
-	vectors[1][2] = (cx * sy * sz) + (sx * cy);
+	if(vertexformat == MDL_VERTEX_PACKED)
+		CopyPackedVertices(trisurf->vertices, (const dmdlpackedvertex_t*)data, trisurf->numvertices);
+	else
+		CopyFloatVertices(trisurf->vertices, (const dmdlvertex_t*)data, trisurf->numvertices);
 
-	vectors[2][0] = (sx * cy * sz) + (cx * sy);
-	vectors[2][1] = (-sx * cz);
-	vectors[2][2] = (-sx * sy * sz) + (cx * cy);
+	ScaleLightLevels(trisurf->vertices, trisurf->numvertices);
 }
 
-// build a current command from the input state
-static void BuildTickCmd()
+static bool ReadIndicies(trisurf_t *trisurf, const unsigned char *data, int indexsize)
 {
-	tickcmd_t *cmd = &gcmd;
-	float scale;
-	
-	// Move forward ~512 units each second (60 * 4.2)
-	scale = 4.2f;
-
-	cmd->forwardmove = 0.0f;
-	cmd->sidemove = 0.0f;
-	cmd->anglemove[0] = 0.0f;
-	cmd->anglemove[1] = 0.0f;
+	modelindex_t *indicies	= (modelindex_t*)Mem_Alloc(trisurf->numindicies * sizeof(modelindex_t));
+	modelindex_t maxindex	= 0;
+	int j;
 
-	if(input.keys['w'])
+	if(indexsize == 2)
 	{
-		cmd->forwardmove += scale;
+		const unsigned short *in = (const unsigned short*)data;
+		for(j = 0; j < trisurf->numindicies; j++)
+			indicies[j] = in[j];
 	}
-
-	if(input.keys['s'])
+	else
 	{
-		cmd->forwardmove -= scale;
+		memcpy(indicies, data, trisurf->numindicies * sizeof(modelindex_t));
 	}
 
-	if(input.keys['d'])
-	{
-		cmd->sidemove += scale;
-	}
+	for(j = 0; j < trisurf->numindicies; j++)
+		maxindex = indicies[j] > maxindex ? indicies[j] : maxindex;
 
-	if(input.keys['a'])
+	if(trisurf->numindicies && maxindex >= (modelindex_t)trisurf->numvertices)
 	{
-		cmd->sidemove -= scale;
+		Warning("Index %u out of range in %s\n", maxindex, filename);
+		return false;
 	}
 
-	// Handle mouse movement
-	if(input.lbuttondown)
-	{
-		cmd->anglemove[0] = -0.01f * (float)input.moused[0];
-		cmd->anglemove[1] = -0.01f * (float)input.moused[1];
-	}
+	trisurf->indicies = indicies;
+	return true;
 }
 
-
-// apply the tick command to the viewstate
-static void DoMove()
+// old files have no header, just the vertex count and data followed by
+// the index count and data
+static bool ReadSurfacesHeaderless(const unsigned char *data, int size, const modelsink_t *sink)
 {
-	tickcmd_t *cmd = &gcmd;
+	trisurf_t out;
+	trisurf_t *trisurf = &out;
+	const unsigned char *count;
+	int ofs = 0;
 
-	VectorsFromSphericalAngles(viewvectors, viewangles);
+	memset(trisurf, 0, sizeof(*trisurf));
+	trisurf->sector = -1;
 
-	viewpos[0] += cmd->forwardmove * viewvectors[0][0];
-	viewpos[1] += cmd->forwardmove * viewvectors[0][1];
-	viewpos[2] += cmd->forwardmove * viewvectors[0][2];
+	if(!(count = FileData(data, size, ofs, sizeof(int))))
+		return false;
+	trisurf->numvertices = *(const int*)count;
+	ofs += sizeof(int);
 
-	viewpos[0] += cmd->sidemove * viewvectors[2][0];
-	viewpos[1] += cmd->sidemove * viewvectors[2][1];
-	viewpos[2] += cmd->sidemove * viewvectors[2][2];
+	if(trisurf->numvertices < 0 || trisurf->numvertices > (size - ofs) / (int)sizeof(dmdlvertex_t))
+	{
+		Warning("%s has a bad vertex count\n", filename);
+		return false;
+	}
 
-	viewangles[0] += cmd->anglemove[0];
-	viewangles[1] += cmd->anglemove[1];
+	ReadVertices(trisurf, data + ofs, MDL_VERTEX_FLOAT);
+	ofs += trisurf->numvertices * sizeof(dmdlvertex_t);
 
-	if(viewangles[1] >= PI / 2.0f)
-		viewangles[1] = (PI / 2.0f) - 0.001f;
-	if(viewangles[1] <= -PI/ 2.0f)
-		viewangles[1] = (-PI / 2.0f) + 0.001f;
-}
+	if(!(count = FileData(data, size, ofs, sizeof(int))))
+		return false;
+	trisurf->numindicies = *(const int*)count;
+	ofs += sizeof(int);
 
-static void SetupDefaultViewPos()
-{
-	// look down negative z
-	viewangles[0] = PI / 2.0f;
-	viewangles[1] = 0.0f;
-	
-	viewpos[0] = 0.0f;
-	viewpos[1] = 0.0f;
-	viewpos[2] = 256.0f;
-}
+	if(trisurf->numindicies < 0 || trisurf->numindicies > (size - ofs) / (int)sizeof(int))
+	{
+		Warning("%s has a bad index count\n", filename);
+		return false;
+	}
 
-// advance the state of everything by one frame
-static void Ticker()
-{
-	BuildTickCmd();
-	
-	DoMove();
+	if(!ReadIndicies(trisurf, data + ofs, 4))
+		return false;
+
+	sink->surface(trisurf);
+	return true;
 }
 
-static void MainLoop()
+// chunks and nodes are only used for culling, files without them are
+// drawn whole. they're read before the surfaces so a model that is still
+// loading can be culled
+static bool ReadChunks(const unsigned char *data, int size, const dmdlheader_t *header, int numsurfaces, const modelsink_t *sink)
 {
-	// initialize the base time
-	if(!oldtime)
-	{
-		oldtime = Sys_Milliseconds();
-	}
+	int i, j;
 
-	int newtime = Sys_Milliseconds();
-	int deltatime = newtime - oldtime;
-	oldtime = newtime;
+	const dmdlchunk_t *chunks = (const dmdlchunk_t*)FileData(data, size, header->lumps[MDL_LUMP_CHUNKS].fileofs, header->lumps[MDL_LUMP_CHUNKS].filelen);
+	if(!chunks)
+		return false;
+
+	int numchunks = header->lumps[MDL_LUMP_CHUNKS].filelen / sizeof(dmdlchunk_t);
 
-	// wait until some time has elapsed
-	if(deltatime < 1)
+	modelchunk_t *outchunks = (modelchunk_t*)Mem_Alloc(numchunks * sizeof(modelchunk_t));
+	for(i = 0; i < numchunks; i++)
 	{
-		Sys_Sleep(1);
-		return;
-	}
+		if(chunks[i].firstsurface < 0 || chunks[i].numsurfaces < 0 || chunks[i].firstsurface > numsurfaces - chunks[i].numsurfaces)
+		{
+			Warning("Chunk %i is out of range in %s\n", i, filename);
+			return false;
+		}
+
+		for(j = 0; j < 3; j++)
+		{
+			outchunks[i].mins[j] = chunks[i].mins[j];
+			outchunks[i].maxs[j] = chunks[i].maxs[j];
+		}
+		outchunks[i].firstsurface = chunks[i].firstsurface;
+		outchunks[i].numsurfaces = chunks[i].numsurfaces;
+	}
+
+	if(header->version < 5)
+	{
+		sink->tree(numchunks, outchunks, 0, NULL);
+		return true;
+	}
+
+	const dmdlnode_t *nodes = (const dmdlnode_t*)FileData(data, size, header->lumps[MDL_LUMP_NODES].fileofs, header->lumps[MDL_LUMP_NODES].filelen);
+	if(!nodes)
+		return false;
+
+	int numnodes = header->lumps[MDL_LUMP_NODES].filelen / sizeof(dmdlnode_t);
+
+	modelnode_t *outnodes = (modelnode_t*)Mem_Alloc(numnodes * sizeof(modelnode_t));
+	for(i = 0; i < numnodes; i++)
+	{
+		for(j = 0; j < 2; j++)
+		{
+			// unlike a doom map, the model format puts children before
+			// their parent (see mdlfile.h), which keeps loops out of the tree
+			int child = nodes[i].children[j];
+			if(child >= i || (child < 0 && -1 - child >= numchunks))
+			{
+				Warning("Node %i has a bad child in %s\n", i, filename);
+				return false;
+			}
+
+			outnodes[i].children[j] = child;
+		}
+
+		for(j = 0; j < 3; j++)
+		{
+			outnodes[i].mins[j] = nodes[i].mins[j];
+			outnodes[i].maxs[j] = nodes[i].maxs[j];
+		}
+	}
+
+	sink->tree(numchunks, outchunks, numnodes, outnodes);
+	return true;
+}
+
+static bool ReadSurfacesMDL(const unsigned char *data, int size, const dmdlheader_t *header, const modelsink_t *sink)
+{
+	if(header->version < 1 || header->version > MDL_VERSION)
+	{
+		Warning("%s is model version %i, expected %i or older\n", filename, header->version, MDL_VERSION);
+		return false;
+	}
+
+	if(header->indexsize != 2 && header->indexsize != 4)
+	{
+		Warning("%s has a bad index size %i\n", filename, header->indexsize);
+		return false;
+	}
+
+	int vertexformat = header->version >= 3 ? header->vertexformat : MDL_VERTEX_FLOAT;
+	int vertexsize;
+
+	if(vertexformat == MDL_VERTEX_FLOAT)
+		vertexsize = sizeof(dmdlvertex_t);
+	else if(vertexformat == MDL_VERTEX_PACKED)
+		vertexsize = sizeof(dmdlpackedvertex_t);
+	else
+	{
+		Warning("%s has an unknown vertex format %i\n", filename, vertexformat);
+		return false;
+	}
+
+	if(header->numvertices < 0 || header->numvertices > header->lumps[MDL_LUMP_VERTICES].filelen / vertexsize ||
+		header->numindicies < 0 || header->numindicies > header->lumps[MDL_LUMP_INDICIES].filelen / header->indexsize)
+	{
+		Warning("%s has bad vertex or index counts\n", filename);
+		return false;
+	}
+
+	const unsigned char *vertices	= FileData(data, size, header->lumps[MDL_LUMP_VERTICES].fileofs, header->lumps[MDL_LUMP_VERTICES].filelen);
+	if(!vertices)
+		return false;
+
+	const unsigned char *indicies	= FileData(data, size, header->lumps[MDL_LUMP_INDICIES].fileofs, header->lumps[MDL_LUMP_INDICIES].filelen);
+	if(!indicies)
+		return false;
+
+	// version 1 files and files without a surface table are one surface
+	dmdlsurface_t whole;
+	const dmdlsurface_t *surfaces = NULL;
+	int numsurfaces = 0;
+
+	if(header->version >= 2)
+	{
+		surfaces = (const dmdlsurface_t*)FileData(data, size, header->lumps[MDL_LUMP_SURFACES].fileofs, header->lumps[MDL_LUMP_SURFACES].filelen);
+		if(!surfaces)
+			return false;
+		numsurfaces = header->lumps[MDL_LUMP_SURFACES].filelen / sizeof(dmdlsurface_t);
+	}
+
+	if(!numsurfaces)
+	{
+		memset(&whole, 0, sizeof(whole));
+		whole.sector		= -1;
+		whole.numvertices	= header->numvertices;
+		whole.numindicies	= header->numindicies;
+
+		surfaces = &whole;
+		numsurfaces = 1;
+	}
+
+	if(header->version >= 4 && !ReadChunks(data, size, header, numsurfaces, sink))
+		return false;
+
+	for(int i = 0; i < numsurfaces; i++)
+	{
+		const dmdlsurface_t *surface = surfaces + i;
+
+		if(surface->firstvertex < 0 || surface->numvertices < 0 || surface->firstvertex > header->numvertices - surface->numvertices ||
+			surface->firstindex < 0 || surface->numindicies < 0 || surface->firstindex > header->numindicies - surface->numindicies)
+		{
+			Warning("Surface %i is out of range in %s\n", i, filename);
+			return false;
+		}
+
+		trisurf_t out;
+		trisurf_t *trisurf = &out;
+
+		memset(trisurf, 0, sizeof(*trisurf));
+		trisurf->sector = surface->sector;
+		memcpy(trisurf->texture, surface->texture, 8);
+		trisurf->texture[8] = 0;
+
+		trisurf->numvertices = surface->numvertices;
+		ReadVertices(trisurf, vertices + surface->firstvertex * vertexsize, vertexformat);
+
+		trisurf->numindicies = surface->numindicies;
+		if(!ReadIndicies(trisurf, indicies + surface->firstindex * header->indexsize, header->indexsize))
+			return false;
+
+		sink->surface(trisurf);
+	}
+
+	return true;
+}
+
+// returns false if the file couldn't be read or is bad, what was read up
+// to there has already gone to the sink and is left in the memstack
+static bool ReadModel(const modelsink_t *sink)
+{
+	int size;
+	bool ok;
+	unsigned char *data = LoadFile(filename, &size);
+
+	if(!data)
+		return false;
+
+	// files before version 3 have a shorter header
+	dmdlheader_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header, data, size < (int)sizeof(header) ? size : sizeof(header));
+
+	if(size >= (int)offsetof(dmdlheader_t, vertexformat) && !memcmp(header.id, MDL_ID, 4))
+		ok = ReadSurfacesMDL(data, size, &header, sink);
+	else
+		ok = ReadSurfacesHeaderless(data, size, sink);
+
+	free(data);
+
+	return ok;
+}
+
+static void PrintModelCounts()
+{
+	int i;
+
+	int numtriangles = 0;
+	int numvertices = 0;
+
+	for(i = 0; i < numtrisurfs; i++)
+	{
+		numvertices += trisurfs[i].numvertices;
+		numtriangles += (trisurfs[i].numindicies / 3);
+	}
+
+	fprintf(stdout, "surface count: %d\n", numtrisurfs);
+	fprintf(stdout, "vertex count: %d\n", numvertices);
+	fprintf(stdout, "triangle count: %d\n", numtriangles);
+
+	Mem_PrintUsage();
+}
+
+static void ReadSurfaces()
+{
+	// free all trisurfs currently allocated
+	FreeAllSurfaces();
+
+	// free any allocated stack memory
+	Mem_FreeStack();
+
+	if(!ReadModel(&modelsink))
+	{
+		Error("Couldn't load %s\n", filename);
+	}
+
+	PrintModelCounts();
+}
+
+//==============================================
+// simulation code
+
+// the view the renderer draws from, in between the last two ticks
+static float viewangles[2];
+static float viewpos[3];
+static float viewvectors[3][3];
+
+// the simulated view before and after the last tick
+typedef struct viewstate_s
+{
+	float	angles[2];
+	float	pos[3];
+
+} viewstate_t;
+
+static viewstate_t oldview;
+static viewstate_t curview;
+
+typedef struct tickcmd_s
+{
+	float	forwardmove;
+	float	sidemove;
+	float	anglemove[2];
+
+} tickcmd_t;
+
+static tickcmd_t gcmd;
+
+static void VectorsFromSphericalAngles(float vectors[3][3], float angles[2])
+{
+	float cx, sx, cy, sy, cz, sz;
+
+	cx = 1.0f;
+	sx = 0.0f;
+	cy = cosf(angles[0]);
+	sy = sinf(angles[0]);
+	cz = cosf(angles[1]);
+	sz = sinf(angles[1]);
+
+	vectors[0][0] = cy * cz;
+	vectors[0][1] = sz;
+	vectors[0][2] = -sy * cz;
+
+	vectors[1][0] = (-cx * cy * sz) + (sx * sy);
+	vectors[1][1] = cx * cz;
+	vectors[1][2] = (cx * sy * sz) + (sx * cy);
+
+	vectors[2][0] = (sx * cy * sz) + (cx * sy);
+	vectors[2][1] = (-sx * cz);
+	vectors[2][2] = (-sx * sy * sz) + (cx * cy);
+}
+
+// Called every tick to process the current mouse input state
+// We only get updates when the mouse moves so the current mouse
+// position is stored and may be used for multiple ticks
+static void ProcessInput()
+{
+	// mousepos has current "frame" mouse pos
+	input.moused[0] = mousepos[0] - input.mousepos[0];
+	input.moused[1] = mousepos[1] - input.mousepos[1];
+	input.mousepos[0] = mousepos[0];
+	input.mousepos[1] = mousepos[1];
+}
+
+// true while there's input the next tick will turn into movement
+static bool InputPending()
+{
+	if(input.keys['w'] || input.keys['s'] || input.keys['a'] || input.keys['d'])
+		return true;
+
+	if(input.lbuttondown && (mousepos[0] != input.mousepos[0] || mousepos[1] != input.mousepos[1]))
+		return true;
+
+	return false;
+}
+
+// build a current command from the input state
+static void BuildTickCmd()
+{
+	tickcmd_t *cmd = &gcmd;
+	float scale;
+	
+	// Move forward ~512 units each second (60 * 4.2)
+	scale = 4.2f;
+
+	cmd->forwardmove = 0.0f;
+	cmd->sidemove = 0.0f;
+	cmd->anglemove[0] = 0.0f;
+	cmd->anglemove[1] = 0.0f;
+
+	if(input.keys['w'])
+	{
+		cmd->forwardmove += scale;
+	}
+
+	if(input.keys['s'])
+	{
+		cmd->forwardmove -= scale;
+	}
+
+	if(input.keys['d'])
+	{
+		cmd->sidemove += scale;
+	}
+
+	if(input.keys['a'])
+	{
+		cmd->sidemove -= scale;
+	}
+
+	// Handle mouse movement
+	if(input.lbuttondown)
+	{
+		cmd->anglemove[0] = -0.01f * (float)input.moused[0];
+		cmd->anglemove[1] = -0.01f * (float)input.moused[1];
+	}
+}
+
+
+// apply the tick command to the viewstate
+static void DoMove()
+{
+	tickcmd_t *cmd = &gcmd;
+	float vectors[3][3];
+
+	VectorsFromSphericalAngles(vectors, curview.angles);
+
+	curview.pos[0] += cmd->forwardmove * vectors[0][0];
+	curview.pos[1] += cmd->forwardmove * vectors[0][1];
+	curview.pos[2] += cmd->forwardmove * vectors[0][2];
+
+	curview.pos[0] += cmd->sidemove * vectors[2][0];
+	curview.pos[1] += cmd->sidemove * vectors[2][1];
+	curview.pos[2] += cmd->sidemove * vectors[2][2];
+
+	curview.angles[0] += cmd->anglemove[0];
+	curview.angles[1] += cmd->anglemove[1];
+
+	if(curview.angles[1] >= PI / 2.0f)
+		curview.angles[1] = (PI / 2.0f) - 0.001f;
+	if(curview.angles[1] <= -PI/ 2.0f)
+		curview.angles[1] = (-PI / 2.0f) + 0.001f;
+}
+
+// set the drawn view frac of the way from the last tick to the current one,
+// returns false if it hasn't changed since it was last set
+static bool InterpolateView(float frac)
+{
+	float angles[2], pos[3];
+	int i;
+
+	// written as from + delta so a view that hasn't moved comes out exact
+	for(i = 0; i < 2; i++)
+		angles[i] = oldview.angles[i] + (curview.angles[i] - oldview.angles[i]) * frac;
+	for(i = 0; i < 3; i++)
+		pos[i] = oldview.pos[i] + (curview.pos[i] - oldview.pos[i]) * frac;
+
+	if(!memcmp(angles, viewangles, sizeof(angles)) && !memcmp(pos, viewpos, sizeof(pos)))
+		return false;
+
+	memcpy(viewangles, angles, sizeof(angles));
+	memcpy(viewpos, pos, sizeof(pos));
+	VectorsFromSphericalAngles(viewvectors, viewangles);
+
+	return true;
+}
+
+static void SetupDefaultViewPos()
+{
+	// look down negative z
+	curview.angles[0] = PI / 2.0f;
+	curview.angles[1] = 0.0f;
 	
-	// figure out how many tick s to run?
-	// sync frames?
-	if(deltatime > 50)
-		deltatime = 0;
+	curview.pos[0] = 0.0f;
+	curview.pos[1] = 0.0f;
+	curview.pos[2] = 256.0f;
+
+	oldview = curview;
+
+	InterpolateView(1.0f);
+}
+
+// advance the state of everything by one tick
+static void Ticker()
+{
+	ProcessInput();
+
+	BuildTickCmd();
+
+	oldview = curview;
+
+	DoMove();
+}
+
+// the simulation runs in fixed ticks of TICK_USEC, frames are drawn in
+// between them, interpolating the view from the last tick towards the
+// current one by however much of the next tick has passed
+#define TICK_USEC		16667	// 60 a second
+#define MAX_FRAME_USEC		250000	// longer stalls aren't caught up
+
+static void MainLoopFunc();
+
+static void StopMainLoop()
+{
+	glutIdleFunc(NULL);
+}
+
+// called from the input callbacks, restart the loop if it went idle
+static void WakeMainLoop()
+{
+	glutIdleFunc(MainLoopFunc);
+}
+
+static void MainLoop()
+{
+	long long newtime = Sys_Microseconds();
+
+	// initialize the base time, and don't simulate the time spent idle
+	if(!oldtime)
+	{
+		oldtime = newtime;
+	}
+
+	long long deltatime = newtime - oldtime;
+	oldtime = newtime;
+
+	if(deltatime > MAX_FRAME_USEC)
+		deltatime = MAX_FRAME_USEC;
+
+	tickaccum += deltatime;
+
+	while(tickaccum >= TICK_USEC)
+	{
+		tickaccum -= TICK_USEC;
+
+		Ticker();
+	}
+
+	// glutPostRedisplay signals the draw callback to be called on the next
+	// pass through the glutMainLoop, only ask for a frame if the view has
+	// moved since the last one
+	bool drawing = false;
+
+	if(!maxfps || newtime >= nextdrawtime)
+	{
+		if(InterpolateView((float)tickaccum / TICK_USEC) || redraw)
+		{
+			glutPostRedisplay();
+
+			redraw = false;
+			drawing = true;
+
+			if(maxfps)
+				nextdrawtime = newtime + 1000000 / maxfps;
+		}
+	}
+
+	// nothing moving and everything drawn, wait for the input callbacks
+	bool settled = !memcmp(&oldview, &curview, sizeof(viewstate_t))
+		&& !memcmp(viewangles, curview.angles, sizeof(viewangles))
+		&& !memcmp(viewpos, curview.pos, sizeof(viewpos));
+
+	if(!drawing && settled && !redraw && !loading && !InputPending())
+	{
+		StopMainLoop();
+
+		oldtime = 0;
+		tickaccum = 0;
+		return;
+	}
+
+	// a new frame goes straight away, otherwise sleep until the next tick
+	// or until the frame cap lets the next frame be drawn
+	if(!drawing)
+	{
+		long long waittime = TICK_USEC - tickaccum;
+
+		if(maxfps && nextdrawtime > newtime && nextdrawtime - newtime < waittime)
+			waittime = nextdrawtime - newtime;
+
+		if(waittime > 0)
+			Sys_SleepMicroseconds(waittime);
+	}
+}
+
+//==============================================
+// OpenGL rendering code
+//
+// this stuff touches some of the simulation state (viewvectors, viewpos etc)
+// guess it should really have an interface to extract that data?
+
+static int renderwidth;
+static int renderheight;
+
+static int rendermode = 0;
+typedef void (*drawfunc_t)();
+
+// static buffer objects need gl 1.5, -nobuffers draws from client memory
+static bool usebuffers = true;
+
+// projection parameters kept for building the view frustum, the tangents
+// are right / znear and top / znear of the projection matrix
+static float projtangents[2];
+static float projznear;
+static float projzfar;
+
+static void GL_LoadMatrix(float m[4][4])
+{
+	glLoadMatrixf((float*)m);
+}
+
+static void GL_LoadMatrixTranspose(float m[4][4])
+{
+	float t[4][4];
+
+	MatrixTranspose(t, m);
+	glLoadMatrixf((float*)t);
+}
+
+static void GL_MultMatrix(float m[4][4])
+{
+	glMultMatrixf((float*)m);
+}
+
+static void GL_MultMatrixTranspose(float m[4][4])
+{
+	float t[4][4];
+
+	MatrixTranspose(t, m);
+	glMultMatrixf((float*)t);
+}
+
+static void DrawAxis()
+{
+	glBegin(GL_LINES);
+	glColor3f(1, 0, 0);
+	glVertex3f(0, 0, 0);
+	glVertex3f(32, 0, 0);
+
+	glColor3f(0, 1, 0);
+	glVertex3f(0, 0, 0);
+	glVertex3f(0, 32, 0);
+
+	glColor3f(0, 0, 1);
+	glVertex3f(0, 0, 0);
+	glVertex3f(0, 0, 32);
+	glEnd();
+}
+
+// called once the context is current, the version can't change after that
+static void GL_CheckBuffers()
+{
+	int major = 0, minor = 0;
+	const char *version = (const char*)glGetString(GL_VERSION);
+
+	if(!usebuffers)
+		return;
+
+	if(!version || sscanf(version, "%d.%d", &major, &minor) != 2
+		|| major < 1 || (major == 1 && minor < 5))
+	{
+		Warning("GL 1.5 buffer objects not available, drawing from client memory\n");
+		usebuffers = false;
+	}
+}
+
+// copies the surfaces into static buffer objects once so drawing doesn't
+// send the vertices and indicies across every frame
+static void UploadTriSurfs(trisurf_t *trisurfs, int numtrisurfs)
+{
+	if(!usebuffers)
+		return;
+
+	for(int i = 0; i < numtrisurfs; i++)
+	{
+		trisurf_t *trisurf = trisurfs + i;
+
+		glGenBuffers(1, &trisurf->vertexbuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, trisurf->vertexbuffer);
+		glBufferData(GL_ARRAY_BUFFER, trisurf->numvertices * sizeof(modelvert_t), trisurf->vertices, GL_STATIC_DRAW);
+
+		glGenBuffers(1, &trisurf->indexbuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trisurf->indexbuffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, trisurf->numindicies * sizeof(modelindex_t), trisurf->indicies, GL_STATIC_DRAW);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+static void DrawTriSurfs(trisurf_t *trisurfs, int numtrisurfs)
+{
+	for(int i = 0; i < numtrisurfs; i++)
+	{
+		trisurf_t *trisurf = trisurfs + i;
+
+		if(trisurf->vertexbuffer)
+		{
+			// pointers are offsets into the bound buffers
+			glBindBuffer(GL_ARRAY_BUFFER, trisurf->vertexbuffer);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trisurf->indexbuffer);
 
-	// update realtime
-	realtime += deltatime;
+			glVertexPointer(3, GL_FLOAT, sizeof(modelvert_t), (void*)offsetof(modelvert_t, xyz));
+			glColorPointer(3, GL_FLOAT, sizeof(modelvert_t), (void*)offsetof(modelvert_t, lightlevel));
 
-	// run a tick if enough time has elapsed
-	// should realtime be clamped if we're dropping frames?
-	//if(realtime > framenum * 16)
-	while(realtime > framenum * 16)
-	{
-		framenum++;
+			glDrawElements(GL_TRIANGLES, trisurf->numindicies, GL_UNSIGNED_INT, NULL);
+		}
+		else
+		{
+			glVertexPointer(3, GL_FLOAT, sizeof(modelvert_t), trisurf->vertices->xyz);
+			glColorPointer(3, GL_FLOAT, sizeof(modelvert_t), trisurf->vertices->lightlevel);
 
-		Ticker();
+			glDrawElements(GL_TRIANGLES, trisurf->numindicies, GL_UNSIGNED_INT, trisurf->indicies);
+		}
 	}
 
-	// signal a screen redraw (should this be sync'd with simulation updates
-	// or free running?) glutPostRedisplay signals the draw callback to be called
-	// on the next pass through the glutMainLoop
-	// run as fast as possible to capture the mouse movements
-	glutPostRedisplay();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 //==============================================
-// OpenGL rendering code
+// frustum culling
 //
-// this stuff touches some of the simulation state (viewvectors, viewpos etc)
-// guess it should really have an interface to extract that data?
+// the frustum is built from the view state and projection in doom
+// coordinates and the node tree is walked from the root, any subtree
+// whose box is outside one of the planes is skipped. the chunks left
+// are drawn by DrawVisibleTriSurfs
 
-static int renderwidth;
-static int renderheight;
+typedef struct plane_s
+{
+	float	normal[3];
+	float	dist;
 
-static int rendermode = 0;
-typedef void (*drawfunc_t)();
+} plane_t;
 
-static void GL_LoadMatrix(float m[4][4])
+static bool cullnodes = true;	// -nocull turns it off
+
+static bool benchmark;
+
+static plane_t frustum[6];
+
+static int numvisiblechunks;
+static int *visiblechunks;
+
+static int *cullstack;
+static int cullsize;
+
+// triangles sent to gl and skipped in the last frame, for one pass
+static int c_submittedtris;
+static int c_culledtris;
+
+// doom x, y, z is gl x, -z, y
+static void GLToDoom(float *out, const float *in)
 {
-	glLoadMatrixf((float*)m);
+	out[0] = in[0];
+	out[1] = -in[2];
+	out[2] = in[1];
 }
 
-static void GL_LoadMatrixTranspose(float m[4][4])
+static void SetPlane(plane_t *plane, float *normal, float *origin)
 {
-	float t[4][4];
+	Vector_Copy(plane->normal, normal);
+	plane->dist = Vector_Dot(normal, origin);
+}
 
-	MatrixTranspose(t, m);
-	glLoadMatrixf((float*)t);
+static void SetupFrustum()
+{
+	float origin[3], forward[3], up[3], right[3];
+	float normal[3];
+	int i;
+
+	GLToDoom(origin, viewpos);
+	GLToDoom(forward, viewvectors[0]);
+	GLToDoom(up, viewvectors[1]);
+	GLToDoom(right, viewvectors[2]);
+
+	// left, right, bottom and top planes all pass through the view origin
+	for(i = 0; i < 3; i++)
+		normal[i] = (forward[i] * projtangents[0]) + right[i];
+	SetPlane(frustum + 0, normal, origin);
+
+	for(i = 0; i < 3; i++)
+		normal[i] = (forward[i] * projtangents[0]) - right[i];
+	SetPlane(frustum + 1, normal, origin);
+
+	for(i = 0; i < 3; i++)
+		normal[i] = (forward[i] * projtangents[1]) + up[i];
+	SetPlane(frustum + 2, normal, origin);
+
+	for(i = 0; i < 3; i++)
+		normal[i] = (forward[i] * projtangents[1]) - up[i];
+	SetPlane(frustum + 3, normal, origin);
+
+	SetPlane(frustum + 4, forward, origin);
+	frustum[4].dist += projznear;
+
+	for(i = 0; i < 3; i++)
+		normal[i] = -forward[i];
+	SetPlane(frustum + 5, normal, origin);
+	frustum[5].dist -= projzfar;
 }
 
-static void GL_MultMatrix(float m[4][4])
+// tests the corner of the box furthest along each plane normal
+static bool BoxOutsideFrustum(const float mins[3], const float maxs[3])
 {
-	glMultMatrixf((float*)m);
+	for(int i = 0; i < 6; i++)
+	{
+		const plane_t *p = frustum + i;
+		float corner[3];
+
+		corner[0] = p->normal[0] >= 0 ? maxs[0] : mins[0];
+		corner[1] = p->normal[1] >= 0 ? maxs[1] : mins[1];
+		corner[2] = p->normal[2] >= 0 ? maxs[2] : mins[2];
+
+		if(Vector_Dot((float*)p->normal, corner) < p->dist)
+			return true;
+	}
+
+	return false;
 }
 
-static void GL_MultMatrixTranspose(float m[4][4])
+static void AddVisibleChunk(int chunk)
 {
-	float t[4][4];
+	const modelchunk_t *c = modelchunks + chunk;
 
-	MatrixTranspose(t, m);
-	glMultMatrixf((float*)t);
+	if(!BoxOutsideFrustum(c->mins, c->maxs))
+		visiblechunks[numvisiblechunks++] = chunk;
 }
 
-static void DrawAxis()
+static void MarkVisibleChunks()
 {
-	glBegin(GL_LINES);
-	glColor3f(1, 0, 0);
-	glVertex3f(0, 0, 0);
-	glVertex3f(32, 0, 0);
+	int i;
 
-	glColor3f(0, 1, 0);
-	glVertex3f(0, 0, 0);
-	glVertex3f(0, 32, 0);
+	// there's at most one entry per node and one for the root on the stack
+	if(cullsize < nummodelchunks + nummodelnodes + 1)
+	{
+		cullsize = nummodelchunks + nummodelnodes + 1;
+		visiblechunks = (int*)realloc(visiblechunks, cullsize * sizeof(int));
+		cullstack = (int*)realloc(cullstack, cullsize * sizeof(int));
+	}
 
-	glColor3f(0, 0, 1);
-	glVertex3f(0, 0, 0);
-	glVertex3f(0, 0, 32);
-	glEnd();
+	numvisiblechunks = 0;
+
+	if(!cullnodes)
+	{
+		for(i = 0; i < nummodelchunks; i++)
+			visiblechunks[numvisiblechunks++] = i;
+		return;
+	}
+
+	SetupFrustum();
+
+	if(!nummodelnodes)
+	{
+		for(i = 0; i < nummodelchunks; i++)
+			AddVisibleChunk(i);
+		return;
+	}
+
+	int top = 0;
+	cullstack[top++] = nummodelnodes - 1;
+
+	while(top)
+	{
+		int num = cullstack[--top];
+
+		if(num < 0)
+		{
+			AddVisibleChunk(-1 - num);
+			continue;
+		}
+
+		const modelnode_t *node = modelnodes + num;
+		if(BoxOutsideFrustum(node->mins, node->maxs))
+			continue;
+
+		cullstack[top++] = node->children[1];
+		cullstack[top++] = node->children[0];
+	}
 }
 
-static void DrawTriSurfs(trisurf_t *trisurfs, int numtrisurfs)
+static int CountTriangles(const trisurf_t *trisurfs, int numtrisurfs)
 {
+	int numtriangles = 0;
+
 	for(int i = 0; i < numtrisurfs; i++)
+		numtriangles += trisurfs[i].numindicies / 3;
+
+	return numtriangles;
+}
+
+static void CountVisibleTriangles()
+{
+	int total = CountTriangles(trisurfs, numtrisurfs);
+
+	c_submittedtris = total;
+	c_culledtris = 0;
+
+	if(!nummodelchunks)
+		return;
+
+	c_submittedtris = 0;
+	for(int i = 0; i < numvisiblechunks; i++)
+	{
+		const modelchunk_t *chunk = modelchunks + visiblechunks[i];
+		c_submittedtris += CountTriangles(trisurfs + chunk->firstsurface, chunk->numsurfaces);
+	}
+
+	c_culledtris = total - c_submittedtris;
+}
+
+// files without chunks have nothing to cull with and are drawn whole
+static void DrawVisibleTriSurfs()
+{
+	if(!nummodelchunks)
 	{
-		glVertexPointer(3, GL_FLOAT, sizeof(modelvert_t), trisurfs[i].vertices->xyz);
-		glColorPointer(3, GL_FLOAT, sizeof(modelvert_t), trisurfs[i].vertices->lightlevel);
+		DrawTriSurfs(trisurfs, numtrisurfs);
+		return;
+	}
+
+	for(int i = 0; i < numvisiblechunks; i++)
+	{
+		const modelchunk_t *chunk = modelchunks + visiblechunks[i];
 
-		//glDrawElements(GL_TRIANGLES, trisurfs[i].numindicies, GL_UNSIGNED_INT, trisurfs[i].indicies);
-		glDrawArrays(GL_TRIANGLES, 0, trisurfs[i].numvertices);
+		// while loading, the end of the chunk may not have arrived yet
+		int numsurfaces = chunk->numsurfaces;
+		if(numsurfaces > numtrisurfs - chunk->firstsurface)
+			numsurfaces = numtrisurfs - chunk->firstsurface;
+
+		if(numsurfaces > 0)
+			DrawTriSurfs(trisurfs + chunk->firstsurface, numsurfaces);
 	}
 }
 
@@ -568,7 +1591,7 @@ static void DrawSurfacesLit()
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_COLOR_ARRAY);
 
-	DrawTriSurfs(trisurfs, numtrisurfs);
+	DrawVisibleTriSurfs();
 
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_COLOR_ARRAY);
@@ -587,13 +1610,13 @@ static void DrawSurfacesWireframe()
 
 	glColor3fv(white);
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	DrawTriSurfs(trisurfs, numtrisurfs);
+	DrawVisibleTriSurfs();
 
 	glColor3fv(black);
 	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	glEnable(GL_POLYGON_OFFSET_FILL);
 	glPolygonOffset(-1, -2);
-	DrawTriSurfs(trisurfs, numtrisurfs);
+	DrawVisibleTriSurfs();
 	glDisable(GL_POLYGON_OFFSET_FILL);
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
@@ -610,6 +1633,11 @@ void DrawSurfaces()
 
 	//drawfunc_t DrawFunc = drawfunclist[rendermode];
 	drawfunc_t DrawFunc = DrawSurfacesWireframe;
+
+	MarkVisibleChunks();
+
+	if(benchmark)
+		CountVisibleTriangles();
 	
 	// call the function to do the drawing
 	DrawFunc();
@@ -663,83 +1691,490 @@ static void SetModelViewMatrix()
 	GL_MultMatrixTranspose(doomtogl);
 }
 
-static void R_SetPerspectiveMatrix(float fov, float aspect, float znear, float zfar)
+static void R_SetPerspectiveMatrix(float fov, float aspect, float znear, float zfar)
+{
+	float r, l, t, b;
+	float fovx, fovy;
+	float m[4][4];
+
+	// fixme: move this somewhere else
+	fovx = fov * (3.1415f / 360.0f);
+	fovy = atan2(atan(fovx), aspect);
+
+	// Calcuate right, left, top and bottom values
+	r = znear * fovx; //tan(fovx * (3.1415f / 360.0f));
+	l = -r;
+
+	t = znear * fovy; //tan(fovy * (3.1415f / 360.0f));
+	b = -t;
+
+	projtangents[0]	= r / znear;
+	projtangents[1]	= t / znear;
+	projznear	= znear;
+	projzfar	= zfar;
+
+	m[0][0] = (2.0f * znear) / (r - l);
+	m[1][0] = 0;
+	m[2][0] = (r + l) / (r - l);
+	m[3][0] = 0;
+
+	m[0][1] = 0;
+	m[1][1] = (2.0f * znear) / (t - b);
+	m[2][1] = (t + b) / (t - b);
+	m[3][1] = 0;
+
+	m[0][2] = 0;
+	m[1][2] = 0;
+	m[2][2] = -(zfar + znear) / (zfar - znear);
+	m[3][2] = -2.0f * zfar * znear / (zfar - znear);
+
+	m[0][3] = 0;
+	m[1][3] = 0;
+	m[2][3] = -1;
+	m[3][3] = 0;
+
+	glMatrixMode(GL_PROJECTION);
+	GL_LoadMatrix(m);
+}
+
+static void BeginFrame()
+{
+	glClearColor(0.3f, 0.3f, 0.3f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	glFrontFace(GL_CW);
+	glEnable(GL_CULL_FACE);
+}
+
+static void Draw()
+{
+	BeginFrame();
+
+	SetModelViewMatrix();
+
+	DrawAxis();
+
+	DrawSurfaces();
+}
+
+//==============================================
+// background loading
+//
+// the model is read on a worker thread which hands each surface to the
+// main thread as soon as it's read, through a ring with one writer and
+// one reader. the main thread uploads and draws whatever has arrived, so a
+// big map can be looked around while it's still loading. the chunks and
+// nodes are sent first so it's culled from the start
+//
+// the worker has the memstack to itself until it's done, nothing on the
+// main thread allocates from it
+//
+// a reload reads into the other memstack while the current model is still
+// drawn. its surfaces are collected on the side and swapped in all at once
+// when the worker is done. if the file is bad or gone they're dropped with
+// the other memstack instead, and the current model stays until the file
+// changes again
+
+#define LOAD_QUEUE_SIZE		4096	// a power of two
+
+typedef struct loadqueue_s
+{
+	trisurf_t		surfaces[LOAD_QUEUE_SIZE];
+	unsigned int	head;		// next to take, only the main thread writes it
+	unsigned int	tail;		// next to fill, only the worker writes it
+
+	int				numchunks;
+	modelchunk_t	*chunks;
+	int				numnodes;
+	modelnode_t		*nodes;
+	int				treeready;
+	int				failed;		// set before done when the read fails
+	int				done;
+
+} loadqueue_t;
+
+static loadqueue_t loadqueue;
+static long long loadstarttime;
+
+static bool reloading;
+static bool reloadpending;		// the file changed again during a load
+
+static int numreloadsurfs;
+static int maxreloadsurfs;
+static trisurf_t *reloadsurfs;
+
+#ifndef WIN32
+static pthread_t loadthread;
+
+// fnv-1a
+static unsigned int HashBytes(unsigned int hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+
+	for(size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+
+	return hash;
+}
+
+static void Load_QueueSurface(const trisurf_t *trisurf)
+{
+	unsigned int tail = loadqueue.tail;
+
+	// wait for the main thread to make room
+	while(tail - __atomic_load_n(&loadqueue.head, __ATOMIC_ACQUIRE) == LOAD_QUEUE_SIZE)
+		Sys_SleepMicroseconds(1000);
+
+	trisurf_t *queued = loadqueue.surfaces + (tail & (LOAD_QUEUE_SIZE - 1));
+
+	*queued = *trisurf;
+	queued->hash = HashBytes(2166136261u, trisurf->vertices, trisurf->numvertices * sizeof(modelvert_t));
+	queued->hash = HashBytes(queued->hash, trisurf->indicies, trisurf->numindicies * sizeof(modelindex_t));
+
+	// the release publishes the surface, and the vertices and indicies it
+	// points at, before the main thread can see the new tail
+	__atomic_store_n(&loadqueue.tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void Load_QueueTree(int numchunks, modelchunk_t *chunks, int numnodes, modelnode_t *nodes)
+{
+	loadqueue.numchunks	= numchunks;
+	loadqueue.chunks	= chunks;
+	loadqueue.numnodes	= numnodes;
+	loadqueue.nodes		= nodes;
+
+	__atomic_store_n(&loadqueue.treeready, 1, __ATOMIC_RELEASE);
+}
+
+static const modelsink_t loadsink = { Load_QueueSurface, Load_QueueTree };
+
+static void *Load_Thread(void *arg)
+{
+	(void)arg;
+
+	if(!ReadModel(&loadsink))
+		loadqueue.failed = 1;
+
+	__atomic_store_n(&loadqueue.done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void Load_StartThread()
+{
+	loadqueue.head		= 0;
+	loadqueue.tail		= 0;
+	loadqueue.treeready	= 0;
+	loadqueue.failed	= 0;
+	loadqueue.done		= 0;
+
+	loadstarttime = Sys_Microseconds();
+
+	if(pthread_create(&loadthread, NULL, Load_Thread, NULL))
+	{
+		Error("Couldn't start the load thread\n");
+	}
+
+	loading = true;
+}
+
+static bool SameSurface(const trisurf_t *a, const trisurf_t *b)
+{
+	return a->hash == b->hash
+		&& a->numvertices == b->numvertices
+		&& a->numindicies == b->numindicies
+		&& !memcmp(a->vertices, b->vertices, a->numvertices * sizeof(modelvert_t))
+		&& !memcmp(a->indicies, b->indicies, a->numindicies * sizeof(modelindex_t));
+}
+
+// the reloaded model replaces the old one between two frames. a surface
+// that is the same as one in the old model takes over its buffers, the
+// rest are uploaded and the old buffers nothing took are deleted
+static void Load_SwapModel()
+{
+	int i, reused = 0;
+
+	if(usebuffers)
+	{
+		// old surfaces by hash, open addressed, 0 is empty
+		int numslots = 1;
+		while(numslots < numtrisurfs * 2)
+			numslots <<= 1;
+
+		int *slots = (int*)calloc(numslots, sizeof(int));
+
+		for(i = 0; i < numtrisurfs; i++)
+		{
+			int slot = trisurfs[i].hash & (numslots - 1);
+			while(slots[slot])
+				slot = (slot + 1) & (numslots - 1);
+			slots[slot] = i + 1;
+		}
+
+		for(i = 0; i < numreloadsurfs; i++)
+		{
+			trisurf_t *trisurf = reloadsurfs + i;
+
+			for(int slot = trisurf->hash & (numslots - 1); slots[slot]; slot = (slot + 1) & (numslots - 1))
+			{
+				trisurf_t *old = trisurfs + slots[slot] - 1;
+
+				// a surface that's been taken has no buffers left
+				if(!old->vertexbuffer || !SameSurface(trisurf, old))
+					continue;
+
+				trisurf->vertexbuffer	= old->vertexbuffer;
+				trisurf->indexbuffer	= old->indexbuffer;
+				old->vertexbuffer	= 0;
+				old->indexbuffer	= 0;
+				reused++;
+				break;
+			}
+
+			if(!trisurf->vertexbuffer)
+				UploadTriSurfs(trisurf, 1);
+		}
+
+		free(slots);
+
+		for(i = 0; i < numtrisurfs; i++)
+		{
+			if(!trisurfs[i].vertexbuffer)
+				continue;
+
+			glDeleteBuffers(1, &trisurfs[i].vertexbuffer);
+			glDeleteBuffers(1, &trisurfs[i].indexbuffer);
+		}
+	}
+
+	// the old array is kept to collect the next reload into
+	trisurf_t *surfaces	= trisurfs;
+	int maxsurfaces		= maxtrisurfs;
+
+	trisurfs		= reloadsurfs;
+	numtrisurfs		= numreloadsurfs;
+	maxtrisurfs		= maxreloadsurfs;
+
+	reloadsurfs		= surfaces;
+	numreloadsurfs	= 0;
+	maxreloadsurfs	= maxsurfaces;
+
+	if(loadqueue.treeready)
+		SetTree(loadqueue.numchunks, loadqueue.chunks, loadqueue.numnodes, loadqueue.nodes);
+	else
+		SetTree(0, NULL, 0, NULL);
+
+	redraw = true;
+
+	fprintf(stdout, "reloaded in %.1f ms, %d of %d surfaces unchanged\n",
+		(Sys_Microseconds() - loadstarttime) / 1000.0, reused, numtrisurfs);
+}
+#endif
+
+// start reading the model, Load_Poll moves it into the view as it arrives
+static void Load_Start()
+{
+	FreeAllSurfaces();
+	Mem_FreeStack();
+
+#ifdef WIN32
+	if(!ReadModel(&modelsink))
+	{
+		Error("Couldn't load %s\n", filename);
+	}
+	UploadTriSurfs(trisurfs, numtrisurfs);
+	PrintModelCounts();
+#else
+	Load_StartThread();
+#endif
+}
+
+// read the model again in the background, keeping the current one and the
+// view until it's done
+static void Load_Reload()
+{
+#ifndef WIN32
+	if(loading)
+	{
+		reloadpending = true;
+		return;
+	}
+
+	// the other stack holds the model before this one, if there was one
+	Mem_SwapStacks();
+	Mem_FreeStack();
+
+	reloading = true;
+	numreloadsurfs = 0;
+
+	Load_StartThread();
+#endif
+}
+
+// called every pass through the main loop, takes everything the worker has
+// queued since the last call
+static void Load_Poll()
 {
-	float r, l, t, b;
-	float fovx, fovy;
-	float m[4][4];
+#ifndef WIN32
+	if(!loading)
+		return;
 
-	// fixme: move this somewhere else
-	fovx = fov * (3.1415f / 360.0f);
-	float x = (renderwidth / 2.0f) / atan(fovx);
-	fovy = atan2(renderheight / 2.0f, x);
+	// read before the tail, so once it's set the tail has every surface
+	int done = __atomic_load_n(&loadqueue.done, __ATOMIC_ACQUIRE);
 
-	// Calcuate right, left, top and bottom values
-	r = znear * fovx; //tan(fovx * (3.1415f / 360.0f));
-	l = -r;
+	if(!reloading && !nummodelchunks && __atomic_load_n(&loadqueue.treeready, __ATOMIC_ACQUIRE))
+		SetTree(loadqueue.numchunks, loadqueue.chunks, loadqueue.numnodes, loadqueue.nodes);
 
-	t = znear * fovy; //tan(fovy * (3.1415f / 360.0f));
-	b = -t;
+	unsigned int head = loadqueue.head;
+	unsigned int tail = __atomic_load_n(&loadqueue.tail, __ATOMIC_ACQUIRE);
+	int first = numtrisurfs;
 
-	m[0][0] = (2.0f * znear) / (r - l);
-	m[1][0] = 0;
-	m[2][0] = (r + l) / (r - l);
-	m[3][0] = 0;
+	for(; head != tail; head++)
+	{
+		const trisurf_t *trisurf = loadqueue.surfaces + (head & (LOAD_QUEUE_SIZE - 1));
 
-	m[0][1] = 0;
-	m[1][1] = (2.0f * znear) / (t - b);
-	m[2][1] = (t + b) / (t - b);
-	m[3][1] = 0;
+		if(reloading)
+			*AllocSurface(&reloadsurfs, &numreloadsurfs, &maxreloadsurfs) = *trisurf;
+		else
+			AddSurface(trisurf);
+	}
 
-	m[0][2] = 0;
-	m[1][2] = 0;
-	m[2][2] = -(zfar + znear) / (zfar - znear);
-	m[3][2] = -2.0f * zfar * znear / (zfar - znear);
+	__atomic_store_n(&loadqueue.head, head, __ATOMIC_RELEASE);
 
-	m[0][3] = 0;
-	m[1][3] = 0;
-	m[2][3] = -1;
-	m[3][3] = 0;
+	if(numtrisurfs != first)
+	{
+		if(!first)
+			fprintf(stdout, "first surfaces after %.1f ms\n", (Sys_Microseconds() - loadstarttime) / 1000.0);
 
-	glMatrixMode(GL_PROJECTION);
-	GL_LoadMatrix(m);
+		UploadTriSurfs(trisurfs + first, numtrisurfs - first);
+		redraw = true;
+	}
+
+	if(done)
+	{
+		pthread_join(loadthread, NULL);
+		loading = false;
+
+		if(reloading && loadqueue.failed)
+		{
+			// drop what was read and go back to the current model's stack,
+			// the next change to the file tries again
+			reloading = false;
+			numreloadsurfs = 0;
+			Mem_FreeStack();
+			Mem_SwapStacks();
+
+			Warning("Couldn't reload %s, keeping the current model\n", filename);
+		}
+		else if(loadqueue.failed)
+		{
+			Error("Couldn't load %s\n", filename);
+		}
+		else if(reloading)
+		{
+			reloading = false;
+			Load_SwapModel();
+		}
+		else
+		{
+			fprintf(stdout, "loaded in %.1f ms\n", (Sys_Microseconds() - loadstarttime) / 1000.0);
+		}
+
+		PrintModelCounts();
+
+		if(reloadpending)
+		{
+			reloadpending = false;
+			Load_Reload();
+		}
+	}
+#endif
 }
 
-static void BeginFrame()
+//==============================================
+// file watching
+//
+// on linux the model's directory is watched with inotify and the model is
+// reloaded when doomtri finishes writing it, either in place or by
+// renaming a new file over it. the watch is polled from a glut timer so it
+// still works when the main loop has gone idle
+
+#define WATCH_MSEC		100
+
+#ifdef __linux__
+static int watchfd = -1;
+static const char *watchname;		// the model's name in its directory
+
+static void Watch_Start()
 {
-	glClearColor(0.3f, 0.3f, 0.3f, 0.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glEnable(GL_DEPTH_TEST);
-	glFrontFace(GL_CW);
-	glEnable(GL_CULL_FACE);
+	char dir[1024];
+	const char *slash = strrchr(filename, '/');
+
+	if(slash)
+	{
+		int len = slash == filename ? 1 : (int)(slash - filename);
+		snprintf(dir, sizeof(dir), "%.*s", len, filename);
+		watchname = slash + 1;
+	}
+	else
+	{
+		strcpy(dir, ".");
+		watchname = filename;
+	}
+
+	watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(watchfd < 0 || inotify_add_watch(watchfd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		Warning("Couldn't watch %s for changes\n", filename);
+
+		if(watchfd >= 0)
+			close(watchfd);
+		watchfd = -1;
+	}
 }
 
-static void Draw()
+// true if the model has been rewritten since the last call
+static bool Watch_Changed()
 {
-	BeginFrame();
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
 
-	SetModelViewMatrix();
+	if(watchfd < 0)
+		return false;
 
-	DrawAxis();
+	for(;;)
+	{
+		ssize_t len = read(watchfd, buffer, sizeof(buffer));
+		if(len <= 0)
+			break;
 
-	DrawSurfaces();
-}
+		for(char *p = buffer; p < buffer + len; )
+		{
+			const struct inotify_event *event = (const struct inotify_event*)p;
 
-//==============================================
-// GLUT/OS/windowing code
+			if(event->len && !strcmp(event->name, watchname))
+				changed = true;
 
-// Called every frame to process the current mouse input state
-// We only get updates when the mouse moves so the current mouse
-// position is stored and may be used for multiple frames
-static void ProcessInput()
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	return changed;
+}
+#else
+static void Watch_Start()
 {
-	// mousepos has current "frame" mouse pos
-	input.moused[0] = mousepos[0] - input.mousepos[0];
-	input.moused[1] = mousepos[1] - input.mousepos[1];
-	input.mousepos[0] = mousepos[0];
-	input.mousepos[1] = mousepos[1];
 }
 
+static bool Watch_Changed()
+{
+	return false;
+}
+#endif
+
+//==============================================
+// GLUT/OS/windowing code
+
 static void DisplayFunc()
 {
 	Draw();
@@ -756,12 +2191,18 @@ static void KeyboardDownFunc(unsigned char key, int x, int y)
 		rendermode++;
 		if(rendermode == 2)
 			rendermode = 0;
+
+		redraw = true;
 	}
+
+	WakeMainLoop();
 }
 
 static void KeyboardUpFunc(unsigned char key, int x, int y)
 {
 	input.keys[key] = false;
+
+	WakeMainLoop();
 }
 
 static void ReshapeFunc(int w, int h)
@@ -780,21 +2221,336 @@ static void MouseFunc(int button, int state, int x, int y)
 		input.lbuttondown = (state == GLUT_DOWN);
 	if(button == GLUT_RIGHT_BUTTON)
 		input.rbuttondown = (state == GLUT_DOWN);
+
+	// the loop doesn't track the mouse while idle, start the drag from here
+	mousepos[0] = input.mousepos[0] = x;
+	mousepos[1] = input.mousepos[1] = y;
+
+	WakeMainLoop();
 }
 
 static void MouseMoveFunc(int x, int y)
 {
 	mousepos[0] = x;
 	mousepos[1] = y;
+
+	WakeMainLoop();
 }
 
 static void MainLoopFunc()
 {
-	ProcessInput();
+	Load_Poll();
 
 	MainLoop();
 }
 
+static void WatchTimerFunc(int value)
+{
+	(void)value;
+
+	if(Watch_Changed())
+	{
+		fprintf(stdout, "%s changed, reloading\n", filename);
+
+		Load_Reload();
+		WakeMainLoop();
+	}
+
+	glutTimerFunc(WATCH_MSEC, WatchTimerFunc, 0);
+}
+
+//==============================================
+// benchmark
+//
+// --bench loads the model, flies the camera along a path and renders each
+// frame offscreen, then prints the load time, frame time percentiles and
+// triangle counts. on linux it runs through an egl context with no window
+// or display, so it works under mesa's software renderer on a machine with
+// no gpu. a path file has a camera per line, "x y z yaw pitch" in map
+// units and degrees. without one the camera orbits the map
+
+typedef struct benchcamera_s
+{
+	float	origin[3];	// doom coordinates
+	float	angles[2];	// yaw and pitch in radians
+
+} benchcamera_t;
+
+static const char *benchpath;
+static int benchframes = 360;
+static int benchwidth = 640;
+static int benchheight = 480;
+
+static int Bench_CompareTimes(const void *a, const void *b)
+{
+	long long ta = *(const long long*)a;
+	long long tb = *(const long long*)b;
+
+	return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+static double Bench_Percentile(const long long *sorted, int count, float percent)
+{
+	int i = (int)((count - 1) * percent / 100.0f + 0.5f);
+
+	return sorted[i] / 1000.0;
+}
+
+static void Bench_PrintTimes(const char *name, long long *times, int count)
+{
+	qsort(times, count, sizeof(long long), Bench_CompareTimes);
+
+	printf("%s ms: p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+		name,
+		Bench_Percentile(times, count, 50),
+		Bench_Percentile(times, count, 90),
+		Bench_Percentile(times, count, 99),
+		times[count - 1] / 1000.0);
+}
+
+static int Bench_ReadPath(const char *filename, benchcamera_t **cameras)
+{
+	FILE *fp = fopen(filename, "r");
+	if(!fp)
+	{
+		Error("Couldn't open camera path %s\n", filename);
+	}
+
+	int numcameras = 0;
+	int maxcameras = 0;
+	char line[256];
+
+	*cameras = NULL;
+
+	while(fgets(line, sizeof(line), fp))
+	{
+		benchcamera_t c;
+
+		if(sscanf(line, "%f %f %f %f %f", &c.origin[0], &c.origin[1], &c.origin[2], &c.angles[0], &c.angles[1]) != 5)
+			continue;
+
+		c.angles[0] *= PI / 180.0f;
+		c.angles[1] *= PI / 180.0f;
+
+		if(numcameras == maxcameras)
+		{
+			maxcameras = maxcameras ? maxcameras * 2 : 256;
+			*cameras = (benchcamera_t*)realloc(*cameras, maxcameras * sizeof(benchcamera_t));
+		}
+
+		(*cameras)[numcameras++] = c;
+	}
+
+	fclose(fp);
+
+	if(!numcameras)
+	{
+		Error("No cameras in %s\n", filename);
+	}
+
+	return numcameras;
+}
+
+// circles the middle of the model from above, looking in at the centre
+static int Bench_OrbitPath(benchcamera_t **cameras, int numframes)
+{
+	float mins[3], maxs[3];
+	int i, j;
+
+	for(j = 0; j < 3; j++)
+	{
+		mins[j] = 0;
+		maxs[j] = 0;
+	}
+
+	bool first = true;
+	for(i = 0; i < numtrisurfs; i++)
+	{
+		for(int k = 0; k < trisurfs[i].numvertices; k++, first = false)
+		{
+			for(j = 0; j < 3; j++)
+			{
+				if(first || trisurfs[i].vertices[k].xyz[j] < mins[j])
+					mins[j] = trisurfs[i].vertices[k].xyz[j];
+				if(first || trisurfs[i].vertices[k].xyz[j] > maxs[j])
+					maxs[j] = trisurfs[i].vertices[k].xyz[j];
+			}
+		}
+	}
+
+	float centre[3];
+	for(j = 0; j < 3; j++)
+		centre[j] = (mins[j] + maxs[j]) * 0.5f;
+
+	float extent = maxs[0] - mins[0] > maxs[1] - mins[1] ? maxs[0] - mins[0] : maxs[1] - mins[1];
+	float radius = extent * 0.4f;
+	float height = maxs[2] + extent * 0.1f;
+
+	*cameras = (benchcamera_t*)malloc(numframes * sizeof(benchcamera_t));
+	for(i = 0; i < numframes; i++)
+	{
+		benchcamera_t *c = *cameras + i;
+		float angle = (2.0f * PI * i) / numframes;
+
+		c->origin[0] = centre[0] + cosf(angle) * radius;
+		c->origin[1] = centre[1] + sinf(angle) * radius;
+		c->origin[2] = height;
+
+		c->angles[0] = angle + PI;
+		c->angles[1] = -atan2f(height - centre[2], radius);
+	}
+
+	return numframes;
+}
+
+// viewpos is in gl coordinates, gl x, y, z is doom x, z, -y
+static void Bench_SetCamera(const benchcamera_t *c)
+{
+	viewpos[0] = c->origin[0];
+	viewpos[1] = c->origin[2];
+	viewpos[2] = -c->origin[1];
+
+	viewangles[0] = c->angles[0];
+	viewangles[1] = c->angles[1];
+
+	VectorsFromSphericalAngles(viewvectors, viewangles);
+}
+
+#ifdef __linux__
+// a context with no surface drawing into a framebuffer object
+static void Bench_CreateContext(int width, int height)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getplatformdisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if(!getplatformdisplay)
+	{
+		Error("--bench needs EGL_EXT_platform_base\n");
+	}
+
+	EGLDisplay display = getplatformdisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if(display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+	{
+		Error("Couldn't initialise a surfaceless EGL display\n");
+	}
+
+	static const EGLint configattribs[] =
+	{
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+
+	EGLConfig config;
+	EGLint numconfigs = 0;
+
+	eglBindAPI(EGL_OPENGL_API);
+	if(!eglChooseConfig(display, configattribs, &config, 1, &numconfigs) || !numconfigs)
+	{
+		Error("No EGL config for desktop GL\n");
+	}
+
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+	if(context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+	{
+		Error("Couldn't create an EGL context\n");
+	}
+
+	GLuint framebuffer, renderbuffers[2];
+
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glGenRenderbuffers(2, renderbuffers);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		Error("Couldn't create the benchmark framebuffer\n");
+	}
+
+	printf("renderer: %s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+	GL_CheckBuffers();
+}
+
+// submit is the time spent issuing the frame, frame also waits for gl to
+// finish drawing it
+static void Bench_Run()
+{
+	int i;
+
+	Bench_CreateContext(benchwidth, benchheight);
+
+	long long starttime = Sys_Microseconds();
+	ReadSurfaces();
+	long long readtime = Sys_Microseconds();
+	UploadTriSurfs(trisurfs, numtrisurfs);
+	glFinish();
+	long long uploadtime = Sys_Microseconds();
+
+	printf("load ms: read %.3f, upload %.3f\n", (readtime - starttime) / 1000.0, (uploadtime - readtime) / 1000.0);
+
+	benchcamera_t *cameras;
+	int numcameras;
+
+	if(benchpath)
+		numcameras = Bench_ReadPath(benchpath, &cameras);
+	else
+		numcameras = Bench_OrbitPath(&cameras, benchframes);
+
+	renderwidth = benchwidth;
+	renderheight = benchheight;
+	R_SetPerspectiveMatrix(90.0f, (float)benchwidth / (float)benchheight, 3, 4096.0f);
+	glViewport(0, 0, benchwidth, benchheight);
+
+	long long *submittimes	= (long long*)malloc(numcameras * sizeof(long long));
+	long long *frametimes	= (long long*)malloc(numcameras * sizeof(long long));
+	double submittedtris	= 0;
+	double culledtris	= 0;
+
+	// one untimed frame so first use costs in the driver aren't counted
+	Bench_SetCamera(cameras);
+	Draw();
+	glFinish();
+
+	for(i = 0; i < numcameras; i++)
+	{
+		Bench_SetCamera(cameras + i);
+
+		long long framestart = Sys_Microseconds();
+		Draw();
+		long long submitend = Sys_Microseconds();
+		glFinish();
+		long long frameend = Sys_Microseconds();
+
+		submittimes[i]	= submitend - framestart;
+		frametimes[i]	= frameend - framestart;
+		submittedtris	+= c_submittedtris;
+		culledtris	+= c_culledtris;
+	}
+
+	printf("frames: %d at %dx%d\n", numcameras, benchwidth, benchheight);
+	Bench_PrintTimes("submit", submittimes, numcameras);
+	Bench_PrintTimes("frame", frametimes, numcameras);
+	printf("triangles per frame: submitted %.0f, culled %.0f\n", submittedtris / numcameras, culledtris / numcameras);
+
+	free(submittimes);
+	free(frametimes);
+	free(cameras);
+}
+#else
+static void Bench_Run()
+{
+	Error("--bench needs EGL and is only supported on linux\n");
+}
+#endif
+
+
 static void ProcessCommandLine(int argc, char *argv[])
 {
 	int i;
@@ -803,6 +2559,22 @@ static void ProcessCommandLine(int argc, char *argv[])
 	{
 		if(argv[i][0] != '-')
 			break;
+
+		if(!strcmp(argv[i], "-nobuffers"))
+			usebuffers = false;
+		if(!strcmp(argv[i], "-nocull"))
+			cullnodes = false;
+		if(!strcmp(argv[i], "-maxfps") && i + 1 < argc)
+			maxfps = atoi(argv[++i]);
+
+		if(!strcmp(argv[i], "--bench"))
+			benchmark = true;
+		if(!strcmp(argv[i], "--path") && i + 1 < argc)
+			benchpath = argv[++i];
+		if(!strcmp(argv[i], "--frames") && i + 1 < argc)
+			benchframes = atoi(argv[++i]);
+		if(!strcmp(argv[i], "--size") && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &benchwidth, &benchheight);
 	}
 
 	if(i == argc)
@@ -810,11 +2582,42 @@ static void ProcessCommandLine(int argc, char *argv[])
 		Error("No input file\n");
 	}
 
+	if(benchframes < 1 || benchwidth < 1 || benchheight < 1)
+	{
+		Error("Bad benchmark frame count or size\n");
+	}
+
+	if(maxfps < 0)
+	{
+		Error("Bad -maxfps\n");
+	}
+
 	filename = argv[i];
 }
 
+static bool IsBenchmark(int argc, char *argv[])
+{
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "--bench"))
+			return true;
+	}
+
+	return false;
+}
+
 int main(int argc, char *argv[])
 {
+	// the benchmark runs without a window, so glut is never started
+	if(IsBenchmark(argc, argv))
+	{
+		ProcessCommandLine(argc, argv);
+
+		Bench_Run();
+
+		return 0;
+	}
+
 	glutInit(&argc, argv);
 	
 	glutInitWindowPosition(0, 0);
@@ -824,9 +2627,13 @@ int main(int argc, char *argv[])
 
 	ProcessCommandLine(argc, argv);
 
+	GL_CheckBuffers();
+
 	SetupDefaultViewPos();
 
-	ReadSurfaces();
+	Load_Start();
+
+	Watch_Start();
 
 	glutReshapeFunc(ReshapeFunc);
 	glutDisplayFunc(DisplayFunc);
@@ -836,6 +2643,7 @@ int main(int argc, char *argv[])
 	glutMotionFunc(MouseMoveFunc);
 	glutPassiveMotionFunc(MouseMoveFunc);
 	glutIdleFunc(MainLoopFunc);
+	glutTimerFunc(WATCH_MSEC, WatchTimerFunc, 0);
 
 	glutMainLoop();
 
@@ -22,53 +22,28 @@ static void Error(const char *format, ...)
         exit(1);
 }
 
-static float Fixed1616ToFloat(int fixed)
+static void DumpVertices(const mapview_t *map)
 {
-	float f;
+	// vertices are whole map units
+	const dvertex_t *vptr	= map->vertices;
 
-	f = 0;
-	f += (float)(fixed / 0x10000);
-	f += (float)(fixed & 0x0000ffff) / 0x10000;
-	
-	return f;
-}
-
-static void DumpVertices(int lumpnum)
-{
-	void	*data;
-	int 	lumpsize;
-
-	data			= Doom_LumpFromNum(lumpnum);
-	lumpsize		= Doom_LumpLength(lumpnum);
-
-	// vertices are 16.16 fixed point
-	int numvertices		= lumpsize / (2 * sizeof(int));
-	int *fixedptr		= (int*)data;
-
-	for(int i = 0; i < numvertices; i++)
+	for(int i = 0; i < map->numvertices; i++)
 	{
 		float xy[2];
 
-		xy[0] = Fixed1616ToFloat(fixedptr[0]);
-		xy[1] = Fixed1616ToFloat(fixedptr[1]);
-		fixedptr += 2;
+		xy[0] = (float)vptr->xy[0];
+		xy[1] = (float)vptr->xy[1];
+		vptr++;
 
 		printf("vertex %4i: %12.4f, %12.4f\n", i, xy[0], xy[1]);
 	}
 }
 
-static void DumpLinedefs(int lumpnum)
+static void DumpLinedefs(const mapview_t *map)
 {
-	void	*data;
-	int 	lumpsize;
+	const dlinedef_t *lptr	= map->linedefs;
 
-	data			= Doom_LumpFromNum(lumpnum);
-	lumpsize		= Doom_LumpLength(lumpnum);
-
-	int numlinedefs		= lumpsize / sizeof(dlinedef_t);
-	dlinedef_t *lptr	= (dlinedef_t*)data;
-
-	for(int i = 0; i < numlinedefs; i++)
+	for(int i = 0; i < map->numlinedefs; i++)
 	{
 		printf("linedefs %4i:", i);
 		printf("\n\tvertices (%i %i)", lptr->vertices[0], lptr->vertices[1]);
@@ -79,18 +54,11 @@ static void DumpLinedefs(int lumpnum)
 	}
 }  
 
-static void DumpSidedefs(int lumpnum)
+static void DumpSidedefs(const mapview_t *map)
 {
-	void	*data;
-	int 	lumpsize;
-
-	data			= Doom_LumpFromNum(lumpnum);
-	lumpsize		= Doom_LumpLength(lumpnum);
-
-	int numsidedefs		= lumpsize / sizeof(dsidedef_t);
-	dsidedef_t *sptr	= (dsidedef_t*)data;
+	const dsidedef_t *sptr	= map->sidedefs;
 
-	for(int i = 0; i < numsidedefs; i++)
+	for(int i = 0; i < map->numsidedefs; i++)
 	{
 		printf("sidedef %4i:", i);
 		printf("\n\toffset (%i %i)", sptr->xoffset, sptr->yoffset);
@@ -102,18 +70,11 @@ static void DumpSidedefs(int lumpnum)
 	}
 }
 
-static void DumpSectors(int lumpnum)
+static void DumpSectors(const mapview_t *map)
 {
-	void	*data;
-	int 	lumpsize;
+	const dsector_t *sptr	= map->sectors;
 
-	data			= Doom_LumpFromNum(lumpnum);
-	lumpsize		= Doom_LumpLength(lumpnum);
-
-	int numsectors		= lumpsize / sizeof(dsector_t);
-	dsector_t *sptr		= (dsector_t*)data;
-
-	for(int i = 0; i < numsectors; i++)
+	for(int i = 0; i < map->numsectors; i++)
 	{
 		printf("sector %4i:", i);
 		printf("\n\tfloor %i, ceiling %i", sptr->floor, sptr->ceiling);
@@ -129,18 +90,20 @@ static void DumpSectors(int lumpnum)
 
 static void DumpMapData(const char *mapname)
 {
-	int baselump = Doom_LumpNumFromName(mapname);
+	mapview_t map;
 
-	if(baselump < 0 || Doom_LumpLength(baselump) != 0)
+	if(Doom_LoadMap(mapname, &map) == -1)
 	{
 		Error("Map \"%s\" not found\n", mapname);
 		exit(-1);
 	}
 
-	DumpLinedefs(baselump + LINEDEFS_OFFSET);
-	DumpSidedefs(baselump + SIDEDEFS_OFFSET);
-	DumpVertices(baselump + VERTICES_OFFSET);
-	DumpSectors(baselump + SECTORS_OFFSET);
+	DumpLinedefs(&map);
+	DumpSidedefs(&map);
+	DumpVertices(&map);
+	DumpSectors(&map);
+
+	Doom_FreeMap(&map);
 }
 
 static void PrintUsage()
@@ -59,15 +59,15 @@ static void DumpLump(wadfile_t *wadfile, int lumpnum)
 // FIXME: pass in patch data?
 static void DrawPatch(int32_t patch_origin_x, int32_t patch_origin_y, uint32_t patch_num)
 {
-	uint8_t *patch_data = (uint8_t*)Wad_ReadLump(wadfile, pnames_table[patch_num]);
+	const uint8_t *patch_data = (const uint8_t*)Wad_LumpView(wadfile, pnames_table[patch_num], NULL);
 	uint16_t w = *(uint16_t*)(patch_data + 0);
 	uint16_t h = *(uint16_t*)(patch_data + 2);
 	uint16_t offset_x = *(uint16_t*)(patch_data + 4);
 	uint16_t offset_y = *(uint16_t*)(patch_data + 6);
-	uint32_t *col_offsets = (uint32_t*)(patch_data + 8);
+	const uint32_t *col_offsets = (const uint32_t*)(patch_data + 8);
 
 	for (int32_t x = 0; x < w; x++) {
-		uint8_t *y_data = patch_data + col_offsets[x];
+		const uint8_t *y_data = patch_data + col_offsets[x];
 
 		while (*y_data != 0xff) {
 			uint8_t y_start = *(y_data + 0);
@@ -106,7 +106,7 @@ int main(int argc, const char * argv[])
 	//}
 
 	// open the wad file
-	wadfile = Wad_Open(argv[1]);
+	wadfile = Wad_OpenMapped(argv[1]);
 	if (!wadfile) {
 		Error("failed to open wad file \'%s\'\n", argv[1]);
 		return 1;
@@ -114,7 +114,7 @@ int main(int argc, const char * argv[])
 
 	// load the palette data
 	uint32_t pal_lump = Wad_LumpNumFromName(wadfile, "PLAYPAL");
-	uint8_t *pal_data = (uint8_t*)Wad_ReadLump(wadfile, pal_lump);
+	const uint8_t *pal_data = (const uint8_t*)Wad_LumpView(wadfile, pal_lump, NULL);
 	for (int i = 0; i < 256; i++) {
 		pal[i][0] = *pal_data++;
 		pal[i][1] = *pal_data++;
@@ -123,7 +123,7 @@ int main(int argc, const char * argv[])
 
 	// load the pnames lump
 	uint32_t pnames_lump = Wad_LumpNumFromName(wadfile, "PNAMES");
-	uint8_t *pnames_data = (uint8_t*)Wad_ReadLump(wadfile, pnames_lump);
+	const uint8_t *pnames_data = (const uint8_t*)Wad_LumpView(wadfile, pnames_lump, NULL);
 
 	int num_pnames = *(uint32_t*)pnames_data;
 	pnames_data += 4;
@@ -131,7 +131,7 @@ int main(int argc, const char * argv[])
 	pnames_table = (uint32_t*)malloc(sizeof(uint32_t) * num_pnames);
 
 	for (int i = 0; i < num_pnames; i++, pnames_data += 8) {
-		char *name = (char*)pnames_data;
+		const char *name = (const char*)pnames_data;
 		pnames_table[i] = Wad_LumpNumFromName(wadfile, name);
 	}
 
@@ -166,14 +166,14 @@ int main(int argc, const char * argv[])
 #if 1
 	// find the texture
 	uint32_t tex_lump = Wad_LumpNumFromName(wadfile, "TEXTURE1");
-	uint8_t *tex_data = (uint8_t*)Wad_ReadLump(wadfile, tex_lump);
-	uint8_t *tex_data_end = tex_data + Wad_LumpSize(wadfile, tex_lump);
+	const uint8_t *tex_data = (const uint8_t*)Wad_LumpView(wadfile, tex_lump, NULL);
+	const uint8_t *tex_data_end = tex_data + Wad_LumpSize(wadfile, tex_lump);
 
 	uint32_t num_textures = *(uint32_t*)tex_data;
 	tex_data += (4 + sizeof(uint32_t) * num_textures);
 
 	while (tex_data != tex_data_end) {
-		char *name = (char*)tex_data;
+		const char *name = (const char*)tex_data;
 		if (!strncmp(name, argv[2], 8)) {
 			break;
 		}
@@ -200,6 +200,31 @@ int main(int argc, const char * argv[])
 	tex_surface = (uint8_t*)malloc(3 * tex_w * tex_h);
 	printf("tex_w=%i, tex_h=%i\n", tex_w, tex_h);
 
+	// start reading the texture's patches in the background, each one once.
+	// a patch missing from the wad has no lump to read
+	int *patch_lumps = (int*)malloc(sizeof(int) * (tex_patch_count ? tex_patch_count : 1));
+	int num_patch_lumps = 0;
+	for (int i = 0; i < tex_patch_count; i++) {
+		uint16_t patch_num = *(uint16_t*)(tex_data + (i * 10) + 4);
+		if (patch_num >= num_pnames) {
+			continue;
+		}
+
+		int lump = (int)pnames_table[patch_num];
+		if (lump < 0) {
+			continue;
+		}
+
+		int j;
+		for (j = 0; j < num_patch_lumps && patch_lumps[j] != lump; j++)
+			;
+		if (j == num_patch_lumps) {
+			patch_lumps[num_patch_lumps++] = lump;
+		}
+	}
+	Wad_PrefetchLumps(wadfile, patch_lumps, num_patch_lumps);
+	free(patch_lumps);
+
 	// read and draw the patches
 	for (int i = 0; i < tex_patch_count; i++) {
 		int32_t patch_origin_x = *(uint16_t*)(tex_data + 0);
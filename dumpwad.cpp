@@ -30,19 +30,14 @@ static void DumpLump(wadfile_t *wadfile, int lumpnum)
 		Error("invalid lump size\n");
 	}
 
-	// read the data block
-	unsigned char *data = (unsigned char*)Wad_ReadLump(wadfile, lumpnum);
+	// view the data block in place
+	const unsigned char *data = (const unsigned char*)Wad_LumpView(wadfile, lumpnum, NULL);
 	if(!data) {
 		Error("couldn't read lump data\n");
 	}
 
 	// dump the data out
-	unsigned char *p = data;
-	while(size--) {
-		fputc(*p++, fp);
-	}
-
-	Wad_FreeLump(data);
+	fwrite(data, 1, size, fp);
 }
 
 int main(int argc, const char * argv[])
@@ -54,7 +49,7 @@ int main(int argc, const char * argv[])
 
 	//Doom_ReadWadFile(argv[1]);
 	// open the wad file
-	wadfile_t *wadfile = Wad_Open(argv[1]);
+	wadfile_t *wadfile = Wad_OpenMapped(argv[1]);
 	if (!wadfile) {
 		Error("failed to open wad file \'%s\'\n", argv[1]);
 		return 1;
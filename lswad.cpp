@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include "doomlib.h"
 
 static void Error(const char *format, ...)
@@ -36,18 +37,32 @@ void ListLumps(wadfile_t *wadfile)
 
 int main(int argc, const char * argv[])
 {
-	if(argc < 2)
+	bool writeindex = false;
+
+	int arg = 1;
+	for(; arg < argc && argv[arg][0] == '-'; arg++)
+	{
+		if (!strcmp(argv[arg], "-i") || !strcmp(argv[arg], "--index"))
+			writeindex = true;
+	}
+
+	if(arg >= argc)
 	{
-		printf("lswad <wadfile>\n");
+		printf("lswad [-i] <wadfile>\n");
+		printf("  -i, --index  write a directory index next to the wad\n");
 		exit(0);
 	}
 
-	wadfile_t *wadfile = Wad_Open(argv[1]);
+	wadfile_t *wadfile = Wad_OpenMapped(argv[arg]);
 	if (!wadfile) {
-		Error("failed to open wad file \'%s\'\n", argv[1]);
+		Error("failed to open wad file \'%s\'\n", argv[arg]);
 		return 1;
 	}
 
+	if (writeindex && Wad_WriteIndex(wadfile) == -1) {
+		Error("failed to write index for \'%s\'\n", argv[arg]);
+	}
+
 	ListLumps(wadfile);
 
 	Wad_Close(wadfile);
@@ -0,0 +1,108 @@
+#ifndef __MDLFILE_H__
+#define __MDLFILE_H__
+
+// model file written by doomtri and read by doomview
+//
+// the header is followed by the lumps it points at. files without the
+// header are the old format, an int vertex count, that many
+// dmdlvertex_t, an int index count and that many 32 bit indicies
+//
+// version 2 added the surface table. a surface's vertices and indicies
+// are ranges of the vertex and index lumps and its indicies count from
+// its first vertex. a file without surfaces is a single surface holding
+// everything
+//
+// version 3 added vertexformat to the end of the header. earlier files
+// are always MDL_VERTEX_FLOAT. doom coordinates and light levels are
+// whole numbers so the packed format holds them exactly in half the space
+//
+// version 4 added chunks. a chunk is the surfaces of one bsp subtree with
+// its bounding box, its surfaces follow one another so its vertices and
+// indicies are each a single run of bytes at vertexofs and indexofs, and
+// a loader can read just the chunks it wants
+//
+// version 5 added the bsp nodes above the chunks. a child is a node
+// number, or -1 - the chunk number for a chunk. children come before
+// their parent so the root is the last node. a file without nodes has
+// no more than one chunk
+#define MDL_ID			"DMDL"
+#define MDL_VERSION		5
+
+#define MDL_LUMP_VERTICES	0
+#define MDL_LUMP_INDICIES	1
+#define MDL_LUMP_SURFACES	2
+#define MDL_LUMP_CHUNKS		3
+#define MDL_LUMP_NODES		4
+#define MDL_MAX_LUMPS		16
+
+#define MDL_VERTEX_FLOAT	0	// dmdlvertex_t
+#define MDL_VERTEX_PACKED	1	// dmdlpackedvertex_t
+
+typedef struct
+{
+	int	fileofs;
+	int	filelen;
+
+} dmdllump_t;
+
+typedef struct
+{
+	char		id[4];
+	int		version;
+	int		numvertices;
+	int		numindicies;
+	int		indexsize;	// 2 or 4, 2 when no surface has more than 65536 vertices
+	dmdllump_t	lumps[MDL_MAX_LUMPS];
+	int		vertexformat;	// version 3 and later
+
+} dmdlheader_t;
+
+typedef struct
+{
+	float	xyz[3];
+	float	lightlevel;
+
+} dmdlvertex_t;
+
+typedef struct
+{
+	short		xyz[3];
+	unsigned char	lightlevel;
+	unsigned char	pad;
+
+} dmdlpackedvertex_t;
+
+// triangles of one sector using one texture
+typedef struct
+{
+	int	sector;
+	char	texture[8];
+	int	firstvertex;
+	int	numvertices;
+	int	firstindex;
+	int	numindicies;
+
+} dmdlsurface_t;
+
+typedef struct
+{
+	short	mins[3];
+	short	maxs[3];
+	int	firstsurface;
+	int	numsurfaces;
+	int	vertexofs;	// byte offsets in the file
+	int	vertexlen;
+	int	indexofs;
+	int	indexlen;
+
+} dmdlchunk_t;
+
+typedef struct
+{
+	short	mins[3];
+	short	maxs[3];
+	int	children[2];
+
+} dmdlnode_t;
+
+#endif
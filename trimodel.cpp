@@ -0,0 +1,1052 @@
+#include "trimodel.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+
+static void Error(const char *format, ...)
+{
+	#define BUFFER_SIZE	1024
+
+        va_list valist;
+        char buffer[BUFFER_SIZE];
+
+        va_start(valist, format);
+        vsnprintf(buffer, BUFFER_SIZE, format, valist);
+        va_end(valist);
+
+        fprintf(stderr, "\x1b[31m");
+        fprintf(stderr, "Error: %s", buffer);
+        fprintf(stderr, "\x1b[0m");
+	fflush(stderr);
+        exit(1);
+}
+
+// =============================================================
+// triangle code
+
+// everything needed to turn one map into triangles. each map gets its
+// own so maps can be built on separate threads
+typedef struct tribuild_s
+{
+	const mapview_t	*level;
+
+	trimodel_t	*model;
+	int		surface;	// triangles are added to this one
+
+	// the nodes reachable from the root with children before their
+	// parent. doom doesn't fix the order of the nodes in a map
+	int		*nodeorder;
+	int		numordered;
+
+	// the chunk each subsector and node goes in (-1 for nodes above the
+	// chunks) and the chunks' xy bounds, worked out before walking the
+	// tree. chunks are numbered again in the order they're built
+	int		*ssectorchunks;
+	int		*nodechunks;
+	trichunk_t	*chunkbounds;
+	int		*chunknums;
+	int		chunk;		// chunk being built, -1 before the first
+
+} tribuild_t;
+
+static void *GrowArray(void *data, int *max, int needed, int elementsize)
+{
+	if(needed <= *max)
+		return data;
+
+	int newmax = *max ? *max : 1024;
+	while(newmax < needed)
+		newmax *= 2;
+
+	data = realloc(data, (size_t)newmax * elementsize);
+	if(!data)
+	{
+		Error("Out of memory growing mesh to %i elements\n", newmax);
+	}
+
+	*max = newmax;
+	return data;
+}
+
+static void FreeMesh(trimesh_t *mesh)
+{
+	free(mesh->vertices);
+	free(mesh->indicies);
+	free(mesh->hashslots);
+	memset(mesh, 0, sizeof(*mesh));
+}
+
+void FreeModel(trimodel_t *model)
+{
+	for(int i = 0; i < model->numsurfaces; i++)
+		FreeMesh(&model->surfaces[i].mesh);
+
+	free(model->surfaces);
+	free(model->chunks);
+	free(model->nodes);
+	free(model->sectorsurfaces);
+	memset(model, 0, sizeof(*model));
+}
+
+// fnv-1a over the vertex bytes, position and light level together
+static unsigned int HashVertex(const trivert_t *v)
+{
+	const unsigned char *p = (const unsigned char*)v;
+	unsigned int hash = 2166136261u;
+
+	for(int i = 0; i < (int)sizeof(trivert_t); i++)
+	{
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void RehashVertices(trimesh_t *mesh)
+{
+	int numslots = mesh->numhashslots ? mesh->numhashslots * 2 : 4096;
+
+	free(mesh->hashslots);
+	mesh->hashslots = (int*)malloc(sizeof(int) * numslots);
+	if(!mesh->hashslots)
+	{
+		Error("Out of memory growing vertex hash to %i slots\n", numslots);
+	}
+
+	memset(mesh->hashslots, -1, sizeof(int) * numslots);
+	mesh->numhashslots = numslots;
+
+	for(int i = 0; i < mesh->numvertices; i++)
+	{
+		unsigned int slot = HashVertex(mesh->vertices + i) & (numslots - 1);
+		while(mesh->hashslots[slot] != -1)
+			slot = (slot + 1) & (numslots - 1);
+
+		mesh->hashslots[slot] = i;
+	}
+}
+
+// returns the index of the vertex, adding it if it hasn't been seen before
+static int AddVertex(trimesh_t *mesh, const trivert_t *v)
+{
+	// keep the table at most half full
+	if((mesh->numvertices + 1) * 2 > mesh->numhashslots)
+		RehashVertices(mesh);
+
+	unsigned int slot = HashVertex(v) & (mesh->numhashslots - 1);
+	while(mesh->hashslots[slot] != -1)
+	{
+		int i = mesh->hashslots[slot];
+		if(!memcmp(mesh->vertices + i, v, sizeof(trivert_t)))
+			return i;
+
+		slot = (slot + 1) & (mesh->numhashslots - 1);
+	}
+
+	mesh->vertices = (trivert_t*)GrowArray(mesh->vertices, &mesh->maxvertices, mesh->numvertices + 1, sizeof(trivert_t));
+	mesh->vertices[mesh->numvertices] = *v;
+	mesh->hashslots[slot] = mesh->numvertices;
+
+	return mesh->numvertices++;
+}
+
+// vertices are built from whole map units and light levels so packing
+// them loses nothing
+static void PackVertex(dmdlpackedvertex_t *out, const trivert_t *v)
+{
+	out->xyz[0]	= (short)v->xyz[0];
+	out->xyz[1]	= (short)v->xyz[1];
+	out->xyz[2]	= (short)v->xyz[2];
+
+	int lightlevel	= (int)v->lightlevel;
+	out->lightlevel	= (unsigned char)(lightlevel < 0 ? 0 : lightlevel > 255 ? 255 : lightlevel);
+	out->pad	= 0;
+}
+
+// see mdlfile.h for the layout. each surface's vertices and indicies are
+// written one after the other, indicies are relative to the surface's
+// first vertex and are written as shorts when every surface allows it
+int WriteTriangleModelFile(const trimodel_t *model, const char *filename, int vertexformat)
+{
+	dmdlheader_t	header;
+	int		i;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.id, MDL_ID, 4);
+	header.version		= MDL_VERSION;
+	header.indexsize	= 2;
+	header.vertexformat	= vertexformat;
+
+	int vertexsize = vertexformat == MDL_VERTEX_PACKED ? sizeof(dmdlpackedvertex_t) : sizeof(dmdlvertex_t);
+
+	for(i = 0; i < model->numsurfaces; i++)
+	{
+		const trimesh_t *mesh = &model->surfaces[i].mesh;
+
+		header.numvertices	+= mesh->numvertices;
+		header.numindicies	+= mesh->numindicies;
+
+		if(mesh->numvertices > 65536)
+			header.indexsize = 4;
+	}
+
+	int fileofs = sizeof(header);
+
+	header.lumps[MDL_LUMP_VERTICES].fileofs	= fileofs;
+	header.lumps[MDL_LUMP_VERTICES].filelen	= header.numvertices * vertexsize;
+	fileofs += header.lumps[MDL_LUMP_VERTICES].filelen;
+
+	header.lumps[MDL_LUMP_INDICIES].fileofs	= fileofs;
+	header.lumps[MDL_LUMP_INDICIES].filelen	= header.numindicies * header.indexsize;
+	fileofs += header.lumps[MDL_LUMP_INDICIES].filelen;
+
+	// keep the surface table aligned
+	fileofs = (fileofs + 3) & ~3;
+
+	header.lumps[MDL_LUMP_SURFACES].fileofs	= fileofs;
+	header.lumps[MDL_LUMP_SURFACES].filelen	= model->numsurfaces * sizeof(dmdlsurface_t);
+	fileofs += header.lumps[MDL_LUMP_SURFACES].filelen;
+
+	header.lumps[MDL_LUMP_CHUNKS].fileofs	= fileofs;
+	header.lumps[MDL_LUMP_CHUNKS].filelen	= model->numchunks * sizeof(dmdlchunk_t);
+	fileofs += header.lumps[MDL_LUMP_CHUNKS].filelen;
+
+	header.lumps[MDL_LUMP_NODES].fileofs	= fileofs;
+	header.lumps[MDL_LUMP_NODES].filelen	= model->numnodes * sizeof(dmdlnode_t);
+	fileofs += header.lumps[MDL_LUMP_NODES].filelen;
+
+	// build the whole file in memory so it goes out in a single write
+	size_t size = fileofs;
+	unsigned char *buffer = (unsigned char*)calloc(size, 1);
+	if(!buffer)
+	{
+		return -1;
+	}
+
+	memcpy(buffer, &header, sizeof(header));
+
+	unsigned char *vertex		= buffer + header.lumps[MDL_LUMP_VERTICES].fileofs;
+	unsigned char *index		= buffer + header.lumps[MDL_LUMP_INDICIES].fileofs;
+	dmdlsurface_t *surface		= (dmdlsurface_t*)(buffer + header.lumps[MDL_LUMP_SURFACES].fileofs);
+	int firstvertex			= 0;
+	int firstindex			= 0;
+
+	for(i = 0; i < model->numsurfaces; i++, surface++)
+	{
+		const trisurface_t *s	= model->surfaces + i;
+		const trimesh_t *mesh	= &s->mesh;
+
+		surface->sector		= s->sector;
+		memcpy(surface->texture, s->texture, 8);
+		surface->firstvertex	= firstvertex;
+		surface->numvertices	= mesh->numvertices;
+		surface->firstindex	= firstindex;
+		surface->numindicies	= mesh->numindicies;
+
+		if(vertexformat == MDL_VERTEX_PACKED)
+		{
+			dmdlpackedvertex_t *p = (dmdlpackedvertex_t*)vertex + firstvertex;
+			for(int j = 0; j < mesh->numvertices; j++)
+				PackVertex(p + j, mesh->vertices + j);
+		}
+		else
+		{
+			memcpy((dmdlvertex_t*)vertex + firstvertex, mesh->vertices, mesh->numvertices * sizeof(dmdlvertex_t));
+		}
+
+		if(header.indexsize == 2)
+		{
+			unsigned short *p = (unsigned short*)index + firstindex;
+			for(int j = 0; j < mesh->numindicies; j++)
+				p[j] = (unsigned short)mesh->indicies[j];
+		}
+		else
+		{
+			memcpy((int*)index + firstindex, mesh->indicies, mesh->numindicies * sizeof(int));
+		}
+
+		firstvertex	+= mesh->numvertices;
+		firstindex	+= mesh->numindicies;
+	}
+
+	// a chunk's surfaces are next to each other so its vertices and
+	// indicies are each one run of bytes
+	surface		= (dmdlsurface_t*)(buffer + header.lumps[MDL_LUMP_SURFACES].fileofs);
+	dmdlchunk_t *chunk	= (dmdlchunk_t*)(buffer + header.lumps[MDL_LUMP_CHUNKS].fileofs);
+
+	for(i = 0; i < model->numchunks; i++, chunk++)
+	{
+		const trichunk_t *c		= model->chunks + i;
+		const dmdlsurface_t *first	= surface + c->firstsurface;
+		const dmdlsurface_t *last	= surface + c->firstsurface + c->numsurfaces;
+		int numvertices			= 0;
+		int numindicies			= 0;
+
+		for(const dmdlsurface_t *sf = first; sf < last; sf++)
+		{
+			numvertices	+= sf->numvertices;
+			numindicies	+= sf->numindicies;
+		}
+
+		memcpy(chunk->mins, c->mins, sizeof(chunk->mins));
+		memcpy(chunk->maxs, c->maxs, sizeof(chunk->maxs));
+		chunk->firstsurface	= c->firstsurface;
+		chunk->numsurfaces	= c->numsurfaces;
+		chunk->vertexofs	= header.lumps[MDL_LUMP_VERTICES].fileofs + (c->numsurfaces ? first->firstvertex * vertexsize : 0);
+		chunk->vertexlen	= numvertices * vertexsize;
+		chunk->indexofs		= header.lumps[MDL_LUMP_INDICIES].fileofs + (c->numsurfaces ? first->firstindex * header.indexsize : 0);
+		chunk->indexlen		= numindicies * header.indexsize;
+	}
+
+	dmdlnode_t *node = (dmdlnode_t*)(buffer + header.lumps[MDL_LUMP_NODES].fileofs);
+	for(i = 0; i < model->numnodes; i++, node++)
+	{
+		memcpy(node->mins, model->nodes[i].mins, sizeof(node->mins));
+		memcpy(node->maxs, model->nodes[i].maxs, sizeof(node->maxs));
+		node->children[0] = model->nodes[i].children[0];
+		node->children[1] = model->nodes[i].children[1];
+	}
+
+	FILE *fp = fopen(filename, "wb");
+	if(!fp)
+	{
+		free(buffer);
+		return -1;
+	}
+
+	bool written = fwrite(buffer, 1, size, fp) == size;
+
+	if(fclose(fp) != 0)
+		written = false;
+
+	free(buffer);
+
+	return written ? 0 : -1;
+}
+
+// picks the surface the following triangles go to, making it if this is
+// the first time the sector and texture have been seen together
+static void SetSurface(tribuild_t *b, int sector, const char texture[8])
+{
+	trimodel_t *model = b->model;
+	int firstsurface = model->chunks[model->numchunks - 1].firstsurface;
+
+	// the chain is newest first, surfaces from earlier chunks aren't reused
+	for(int i = model->sectorsurfaces[sector]; i != -1 && i >= firstsurface; i = model->surfaces[i].next)
+	{
+		if(!strncmp(model->surfaces[i].texture, texture, 8))
+		{
+			b->surface = i;
+			return;
+		}
+	}
+
+	model->surfaces = (trisurface_t*)GrowArray(model->surfaces, &model->maxsurfaces, model->numsurfaces + 1, sizeof(trisurface_t));
+
+	trisurface_t *s = model->surfaces + model->numsurfaces;
+	memset(s, 0, sizeof(*s));
+	s->sector = sector;
+	// lump names fill all 8 chars with no terminator, the memset above
+	// pads shorter names with zeros
+	for(int i = 0; i < 8 && texture[i]; i++)
+		s->texture[i] = texture[i];
+	s->next = model->sectorsurfaces[sector];
+	model->sectorsurfaces[sector] = model->numsurfaces;
+
+	b->surface = model->numsurfaces++;
+}
+
+// interface to the triangle code
+static void AddTriangle(tribuild_t *b, trivert_t v0, trivert_t v1, trivert_t v2)
+{
+	trimesh_t *mesh = &b->model->surfaces[b->surface].mesh;
+
+	//printf("adding triangle:\n");
+	//printf("(%f %f %f)\n", v0.xyz[0], v0.xyz[1], v0.xyz[2]);
+	//printf("(%f %f %f)\n", v1.xyz[0], v1.xyz[1], v1.xyz[2]);
+	//printf("(%f %f %f)\n", v2.xyz[0], v2.xyz[1], v2.xyz[2]);
+
+	mesh->indicies = (int*)GrowArray(mesh->indicies, &mesh->maxindicies, mesh->numindicies + 3, sizeof(int));
+
+	int *index = mesh->indicies + mesh->numindicies;
+	index[0] = AddVertex(mesh, &v0);
+	index[1] = AddVertex(mesh, &v1);
+	index[2] = AddVertex(mesh, &v2);
+
+	mesh->numindicies += 3;
+}
+
+// =============================================================
+// geometry generation code
+
+static float Fixed16ToFloat(int fixed)
+{
+	return (float)fixed;
+}
+
+static void SidedefsFromLinedef(tribuild_t *b, const dsidedef_t *s[2], const dlinedef_t *l)
+{
+	for(int i = 0; i < 2; i++)
+	{
+		if(l->sidedefs[i] == -1)
+		{
+			s[i]	= NULL;
+			continue;
+		}
+
+		s[i] = b->level->sidedefs + l->sidedefs[i];
+	}
+}
+
+static const dnode_t *NodeFromNum(tribuild_t *b, int num)
+{
+	return b->level->nodes + num;
+}
+
+static const dsector_t *SectorFromNum(tribuild_t *b, int num)
+{
+	return b->level->sectors + num;
+}
+
+static int SegSortFunc(const void *a, const void *b)
+{
+	const dseg_t	*sa = *(const dseg_t**)a;
+	const dseg_t	*sb = *(const dseg_t**)b;
+
+
+
+	int result = sb->vertices[0] - sa->vertices[1];
+
+	//if(result < 0)
+	//	result = -result;
+
+	//return sa->vertices[0] - sb->vertices[0];
+
+	return result;
+}
+
+static void SortSegs(tribuild_t *b, const dssector_t *ss)
+{
+	const dseg_t *segarray[2048];
+
+	const dseg_t *seg	= b->level->segs + ss->startseg;
+	for(int i = 0; i < ss->numsegs; i++, seg++)
+	{
+		segarray[i] = seg;
+	}
+
+	qsort(segarray, ss->numsegs, sizeof(const dseg_t*), SegSortFunc);
+
+	for(int i = 0; i < ss->numsegs; i++)
+	{
+		seg = segarray[i];
+		printf( "%i, (%i %i), start=(%f, %f), end=(%f, %f), offset=%i\n",
+			i,
+			seg->vertices[0],
+			seg->vertices[1],
+			Fixed16ToFloat(b->level->vertices[seg->vertices[0]].xy[0]),
+			Fixed16ToFloat(b->level->vertices[seg->vertices[0]].xy[1]),
+			Fixed16ToFloat(b->level->vertices[seg->vertices[1]].xy[0]),
+			Fixed16ToFloat(b->level->vertices[seg->vertices[1]].xy[1]),
+			seg->offset);
+	}
+}
+
+
+
+//void EmitMiddleWallGeometry()
+//void EmitUpperAndLowerWallGeometry()
+//void EmitFloorAndCeilingGeometry()
+
+// if single sided, emit middle polygon
+// if double sided emit middle, lower and upper polygon
+static void SegVertexData(tribuild_t *b, float xy[2][2], const dseg_t *seg)
+{
+	// get the vertex data for the seg
+	if(seg->side == 0)
+	{
+		xy[0][0] = Fixed16ToFloat(b->level->vertices[seg->vertices[0]].xy[0]);
+		xy[0][1] = Fixed16ToFloat(b->level->vertices[seg->vertices[0]].xy[1]);
+		xy[1][0] = Fixed16ToFloat(b->level->vertices[seg->vertices[1]].xy[0]);
+		xy[1][1] = Fixed16ToFloat(b->level->vertices[seg->vertices[1]].xy[1]);
+	}
+	else
+	{
+		xy[1][0] = Fixed16ToFloat(b->level->vertices[seg->vertices[0]].xy[0]);
+		xy[1][1] = Fixed16ToFloat(b->level->vertices[seg->vertices[0]].xy[1]);
+		xy[0][0] = Fixed16ToFloat(b->level->vertices[seg->vertices[1]].xy[0]); 
+		xy[0][1] = Fixed16ToFloat(b->level->vertices[seg->vertices[1]].xy[1]); 
+	}
+
+	float dx, dy;
+	dx = xy[1][0] - xy[0][0];
+	dy = xy[1][1] - xy[0][1];
+
+	// calculate a normal for the linedef
+	float nx, ny;
+	nx = dx / sqrtf((dx * dx) + (dy * dy));
+	ny = dy / sqrtf((dx * dx) + (dy * dy));
+
+	//xy[0][0] += (nx * seg->offset);
+	//xy[0][1] += (ny * seg->offset);
+
+	//xy[0][0] += sqrt((seg->offset * seg->offset) - (dy * dy));
+	//xy[0][1] += sqrt((seg->offset * seg->offset) - (dx * dx));
+	//float length = sqrtf((dx * dx) + (dy * dy));
+	//xy[0][0] += dx * (seg->offset / length);
+	//xy[0][1] += dy * (seg->offset / length);
+}
+
+// fixme: could reverse test
+static void EmitMiddleWallGeometry(tribuild_t *b, const dseg_t *seg)
+{
+	const dlinedef_t *ld		= b->level->linedefs + seg->linedef;
+	const dsidedef_t *sd		= b->level->sidedefs + ld->sidedefs[seg->side];
+	const dsector_t *sector	= b->level->sectors + sd->sector;
+
+	if(sd->textures[2][0] != '-')
+	{
+		SetSurface(b, sd->sector, sd->textures[2]);
+
+		// get the seg vertex data
+		float xy[2][2];
+		SegVertexData(b, xy, seg);
+		
+		// build the 4 triverts that we need
+		trivert_t	trivert[4];
+
+		trivert[0].xyz[0]	= xy[0][0];
+		trivert[0].xyz[1]	= xy[0][1];
+		trivert[0].xyz[2]	= sector->ceiling;
+		trivert[0].lightlevel	= sector->lightlevel;
+
+		trivert[1].xyz[0]	= xy[0][0];
+		trivert[1].xyz[1]	= xy[0][1];
+		trivert[1].xyz[2]	= sector->floor;
+		trivert[1].lightlevel	= sector->lightlevel;
+
+		trivert[2].xyz[0]	= xy[1][0];
+		trivert[2].xyz[1]	= xy[1][1];
+		trivert[2].xyz[2]	= sector->ceiling;
+		trivert[2].lightlevel	= sector->lightlevel;
+
+		trivert[3].xyz[0]	= xy[1][0];
+		trivert[3].xyz[1]	= xy[1][1];
+		trivert[3].xyz[2]	= sector->floor;
+		trivert[3].lightlevel	= sector->lightlevel;
+
+		// this is the order for a triangle strip
+		//AddTriangle(b, trivert[0], trivert[1], trivert[2]);
+		//AddTriangle(b, trivert[1], trivert[2], trivert[3]);
+
+		// triangle soup, counter clockwise wound
+		AddTriangle(b, trivert[0], trivert[1], trivert[2]);
+		AddTriangle(b, trivert[3], trivert[2], trivert[1]);
+	}
+
+}
+
+static void EmitUpperAndLowerWallGeometry(tribuild_t *b, const dseg_t *seg)
+{
+	const dsidedef_t *sd[2];
+	const dsector_t *sectors[2];
+
+	// only emit if this is a double sided line
+	const dlinedef_t *ld		= b->level->linedefs + seg->linedef;
+
+	if(ld->sidedefs[1] == -1)
+		return;
+
+	if(seg->side == 0)
+	{
+		sd[0]		= b->level->sidedefs + ld->sidedefs[0];
+		sd[1]		= b->level->sidedefs + ld->sidedefs[1];
+	}
+	else
+	{
+		sd[1]		= b->level->sidedefs + ld->sidedefs[0];
+		sd[0]		= b->level->sidedefs + ld->sidedefs[1];
+	}
+
+	sectors[0]	= b->level->sectors + sd[0]->sector;
+	sectors[1]	= b->level->sectors + sd[1]->sector;
+
+	if((sectors[0]->floor < sectors[1]->floor)) // && sd[0]->textures[1][0] != '-')
+	{
+		SetSurface(b, sd[0]->sector, sd[0]->textures[1]);
+
+		// build the 4 triverts that we need
+		trivert_t	trivert[4];
+
+		// get the seg vertex data
+		float xy[2][2];
+		SegVertexData(b, xy, seg);
+
+		trivert[0].xyz[0]	= xy[0][0];
+		trivert[0].xyz[1]	= xy[0][1];
+		trivert[0].xyz[2]	= sectors[1]->floor;
+		trivert[0].lightlevel	= sectors[0]->lightlevel;
+
+		trivert[1].xyz[0]	= xy[0][0];
+		trivert[1].xyz[1]	= xy[0][1];
+		trivert[1].xyz[2]	= sectors[0]->floor;
+		trivert[1].lightlevel	= sectors[0]->lightlevel;
+
+		trivert[2].xyz[0]	= xy[1][0];
+		trivert[2].xyz[1]	= xy[1][1];
+		trivert[2].xyz[2]	= sectors[1]->floor;
+		trivert[2].lightlevel	= sectors[0]->lightlevel;
+
+		trivert[3].xyz[0]	= xy[1][0];
+		trivert[3].xyz[1]	= xy[1][1];
+		trivert[3].xyz[2]	= sectors[0]->floor;
+		trivert[3].lightlevel	= sectors[0]->lightlevel;
+
+		//AddTriangle(b, trivert[0], trivert[1], trivert[2]);
+		//AddTriangle(b, trivert[1], trivert[2], trivert[3]);
+
+		// triangle soup, counter clockwise wound
+		AddTriangle(b, trivert[0], trivert[1], trivert[2]);
+		AddTriangle(b, trivert[3], trivert[2], trivert[1]);
+	}
+
+	if((sectors[0]->ceiling > sectors[1]->ceiling)) // && sd[0]->textures[0][0] != '-')
+	{
+		SetSurface(b, sd[0]->sector, sd[0]->textures[0]);
+
+		// build the 4 triverts that we need
+		trivert_t	trivert[4];
+
+		// get the seg vertex data
+		float xy[2][2];
+		SegVertexData(b, xy, seg);
+
+		trivert[0].xyz[0]	= xy[0][0];
+		trivert[0].xyz[1]	= xy[0][1];
+		trivert[0].xyz[2]	= sectors[1]->ceiling;
+		trivert[0].lightlevel	= sectors[0]->lightlevel;
+
+		trivert[1].xyz[0]	= xy[0][0];
+		trivert[1].xyz[1]	= xy[0][1];
+		trivert[1].xyz[2]	= sectors[0]->ceiling;
+		trivert[1].lightlevel	= sectors[0]->lightlevel;
+
+		trivert[2].xyz[0]	= xy[1][0];
+		trivert[2].xyz[1]	= xy[1][1];
+		trivert[2].xyz[2]	= sectors[1]->ceiling;
+		trivert[2].lightlevel	= sectors[0]->lightlevel;
+
+		trivert[3].xyz[0]	= xy[1][0];
+		trivert[3].xyz[1]	= xy[1][1];
+		trivert[3].xyz[2]	= sectors[0]->ceiling;
+		trivert[3].lightlevel	= sectors[0]->lightlevel;
+
+		//AddTriangle(b, trivert[0], trivert[1], trivert[2]);
+		//AddTriangle(b, trivert[1], trivert[2], trivert[3]);
+
+		// triangle soup, counter clockwise wound
+		AddTriangle(b, trivert[0], trivert[1], trivert[2]);
+		AddTriangle(b, trivert[3], trivert[2], trivert[1]);
+	}
+}
+
+static void ProcessSubSector(tribuild_t *b, const dssector_t *ss)
+{
+	int i;
+
+#if 0
+	{
+		printf("ssector: ------------------------------------\n");
+		const dseg_t *seg	= b->level->segs + ss->startseg;
+		for(i = 0; i < ss->numsegs; i++, seg++)
+		{
+			const dlinedef_t *ld = b->level->linedefs + seg->linedef;
+			printf("seg: %i: vertices=(%i %i) levertices(%i %i) offset=%i\n",
+					i,
+					seg->vertices[0],
+					seg->vertices[1],
+					ld->vertices[0],
+					ld->vertices[1],
+					seg->offset);
+		}
+	}
+#endif	
+
+	{
+		const dseg_t *seg	= b->level->segs + ss->startseg;
+		for(i = 0; i < ss->numsegs; i++, seg++)
+		{
+			EmitMiddleWallGeometry(b, seg);
+		}
+	}
+
+	{
+		const dseg_t *seg	= b->level->segs + ss->startseg;
+		for(i = 0; i < ss->numsegs; i++, seg++)
+		{
+			EmitUpperAndLowerWallGeometry(b, seg);
+		}
+	}
+
+}
+
+// =============================================================
+// chunking
+
+// the largest subtree, in subsectors, that is put in one chunk
+#define MAX_CHUNK_SUBSECTORS	64
+
+// doom node bounds are top, bottom, left, right for each child
+static void ChunkBoundsFromNode(trichunk_t *chunk, const dnode_t *node, int child)
+{
+	const short *box = node->bounds + child * 4;
+
+	chunk->mins[0]	= box[2];
+	chunk->mins[1]	= box[1];
+	chunk->maxs[0]	= box[3];
+	chunk->maxs[1]	= box[0];
+}
+
+// lists the nodes as a node builder writes them, the subtree of child 0,
+// then child 1, then the node itself. Doom_LoadMap has checked no node is
+// reached twice so the stack never holds more than one entry per node
+static void OrderNodes(tribuild_t *b)
+{
+	const mapview_t *level = b->level;
+
+	int *stack	= (int*)malloc(sizeof(int) * level->numnodes);
+	bool *expanded	= (bool*)calloc(level->numnodes, sizeof(bool));
+	int top		= 0;
+
+	b->nodeorder	= (int*)malloc(sizeof(int) * level->numnodes);
+	b->numordered	= 0;
+
+	stack[top++] = level->numnodes - 1;
+
+	while(top)
+	{
+		int num = stack[top - 1];
+
+		// the node goes in once both its subtrees are in
+		if(expanded[num])
+		{
+			b->nodeorder[b->numordered++] = num;
+			top--;
+			continue;
+		}
+
+		expanded[num] = true;
+
+		for(int j = 1; j >= 0; j--)
+		{
+			unsigned short child = (unsigned short)level->nodes[num].children[j];
+
+			if(!(child & 0x8000))
+				stack[top++] = child;
+		}
+	}
+
+	free(stack);
+	free(expanded);
+}
+
+// splits the tree into chunks, each the largest subtree with no more than
+// MAX_CHUNK_SUBSECTORS subsectors. a subsector hanging off a node that's
+// too big is a chunk on its own. counts are summed going up the node order
+// and chunks handed down it going the other way
+static void PlanChunks(tribuild_t *b)
+{
+	const mapview_t *level = b->level;
+	int i, j;
+
+	b->ssectorchunks	= (int*)malloc(sizeof(int) * level->numssectors);
+	b->chunkbounds		= (trichunk_t*)calloc(level->numnodes + level->numssectors, sizeof(trichunk_t));
+	b->chunknums		= (int*)malloc(sizeof(int) * (level->numnodes + level->numssectors));
+
+	// a map without nodes is one subsector, give it the bounds of the vertices
+	if(!level->numnodes)
+	{
+		trichunk_t *chunk = b->chunkbounds;
+
+		for(i = 0; i < level->numvertices; i++)
+		{
+			for(j = 0; j < 2; j++)
+			{
+				if(!i || level->vertices[i].xy[j] < chunk->mins[j])
+					chunk->mins[j] = level->vertices[i].xy[j];
+				if(!i || level->vertices[i].xy[j] > chunk->maxs[j])
+					chunk->maxs[j] = level->vertices[i].xy[j];
+			}
+		}
+
+		b->ssectorchunks[0] = 0;
+		return;
+	}
+
+	int *counts	= (int*)malloc(sizeof(int) * level->numnodes);
+	int *nodechunks	= (int*)malloc(sizeof(int) * level->numnodes);
+	int numchunks	= 0;
+
+	b->nodechunks = nodechunks;
+
+	OrderNodes(b);
+
+	for(i = 0; i < level->numnodes; i++)
+		nodechunks[i] = -1;
+
+	for(int k = 0; k < b->numordered; k++)
+	{
+		i = b->nodeorder[k];
+
+		counts[i] = 0;
+		for(j = 0; j < 2; j++)
+		{
+			unsigned short child = (unsigned short)level->nodes[i].children[j];
+			counts[i] += (child & 0x8000) ? 1 : counts[child];
+		}
+	}
+
+	for(int k = b->numordered - 1; k >= 0; k--)
+	{
+		i = b->nodeorder[k];
+
+		const dnode_t *node = level->nodes + i;
+
+		if(nodechunks[i] == -1 && counts[i] <= MAX_CHUNK_SUBSECTORS)
+		{
+			nodechunks[i] = numchunks++;
+			ChunkBoundsFromNode(b->chunkbounds + nodechunks[i], node, 0);
+
+			trichunk_t other;
+			ChunkBoundsFromNode(&other, node, 1);
+
+			trichunk_t *chunk = b->chunkbounds + nodechunks[i];
+			for(j = 0; j < 2; j++)
+			{
+				if(other.mins[j] < chunk->mins[j])
+					chunk->mins[j] = other.mins[j];
+				if(other.maxs[j] > chunk->maxs[j])
+					chunk->maxs[j] = other.maxs[j];
+			}
+		}
+
+		for(j = 0; j < 2; j++)
+		{
+			unsigned short child = (unsigned short)node->children[j];
+
+			if(!(child & 0x8000))
+			{
+				nodechunks[child] = nodechunks[i];
+				continue;
+			}
+
+			if(nodechunks[i] != -1)
+			{
+				b->ssectorchunks[child & 0x7fff] = nodechunks[i];
+				continue;
+			}
+
+			b->ssectorchunks[child & 0x7fff] = numchunks;
+			ChunkBoundsFromNode(b->chunkbounds + numchunks, node, j);
+			numchunks++;
+		}
+	}
+
+	free(counts);
+}
+
+// a chunk's subtree is walked in one go, so a new chunk starts whenever
+// the walk moves to a subsector from another one
+static void BeginChunk(tribuild_t *b, int chunk)
+{
+	trimodel_t *model = b->model;
+
+	model->chunks = (trichunk_t*)GrowArray(model->chunks, &model->maxchunks, model->numchunks + 1, sizeof(trichunk_t));
+
+	trichunk_t *c = model->chunks + model->numchunks;
+	*c = b->chunkbounds[chunk];
+	c->firstsurface = model->numsurfaces;
+
+	b->chunknums[chunk] = model->numchunks++;
+	b->chunk = chunk;
+}
+
+// the surface counts and heights are only known once everything is built
+static void FinishChunks(trimodel_t *model)
+{
+	for(int i = 0; i < model->numchunks; i++)
+	{
+		trichunk_t *c	= model->chunks + i;
+		int last	= i + 1 < model->numchunks ? model->chunks[i + 1].firstsurface : model->numsurfaces;
+		bool first	= true;
+
+		c->numsurfaces	= last - c->firstsurface;
+		c->mins[2]	= 0;
+		c->maxs[2]	= 0;
+
+		for(int j = c->firstsurface; j < last; j++)
+		{
+			const trimesh_t *mesh = &model->surfaces[j].mesh;
+
+			for(int k = 0; k < mesh->numvertices; k++, first = false)
+			{
+				short z = (short)mesh->vertices[k].xyz[2];
+
+				if(first || z < c->mins[2])
+					c->mins[2] = z;
+				if(first || z > c->maxs[2])
+					c->maxs[2] = z;
+			}
+		}
+	}
+}
+
+static void AddBounds(trinode_t *node, const short mins[3], const short maxs[3])
+{
+	for(int i = 0; i < 3; i++)
+	{
+		if(mins[i] < node->mins[i])
+			node->mins[i] = mins[i];
+		if(maxs[i] > node->maxs[i])
+			node->maxs[i] = maxs[i];
+	}
+}
+
+// copies the bsp nodes above the chunks into the model in the node order,
+// so children come first as the model format wants. the xy bounds come
+// from the doom nodes and the heights from the children
+static void BuildNodes(tribuild_t *b)
+{
+	const mapview_t *level	= b->level;
+	trimodel_t *model	= b->model;
+	int i, j;
+
+	if(!level->numnodes)
+		return;
+
+	int *nodenums = (int*)malloc(sizeof(int) * level->numnodes);
+
+	model->nodes	= (trinode_t*)malloc(sizeof(trinode_t) * level->numnodes);
+	model->numnodes	= 0;
+
+	for(int k = 0; k < b->numordered; k++)
+	{
+		i = b->nodeorder[k];
+
+		const dnode_t *dnode = level->nodes + i;
+
+		if(b->nodechunks[i] != -1)
+			continue;
+
+		trinode_t *node = model->nodes + model->numnodes;
+		bool first = true;
+
+		for(j = 0; j < 2; j++)
+		{
+			unsigned short child = (unsigned short)dnode->children[j];
+			short mins[3], maxs[3];
+
+			if(child & 0x8000)
+			{
+				node->children[j] = -1 - b->chunknums[b->ssectorchunks[child & 0x7fff]];
+			}
+			else if(b->nodechunks[child] != -1)
+			{
+				node->children[j] = -1 - b->chunknums[b->nodechunks[child]];
+			}
+			else
+			{
+				node->children[j] = nodenums[child];
+			}
+
+			// doom node bounds are top, bottom, left, right for each child
+			const short *box = dnode->bounds + j * 4;
+			mins[0] = box[2];
+			mins[1] = box[1];
+			maxs[0] = box[3];
+			maxs[1] = box[0];
+
+			if(node->children[j] < 0)
+			{
+				mins[2] = model->chunks[-1 - node->children[j]].mins[2];
+				maxs[2] = model->chunks[-1 - node->children[j]].maxs[2];
+			}
+			else
+			{
+				mins[2] = model->nodes[node->children[j]].mins[2];
+				maxs[2] = model->nodes[node->children[j]].maxs[2];
+			}
+
+			if(first)
+			{
+				memcpy(node->mins, mins, sizeof(mins));
+				memcpy(node->maxs, maxs, sizeof(maxs));
+				first = false;
+			}
+			else
+			{
+				AddBounds(node, mins, maxs);
+			}
+		}
+
+		nodenums[i] = model->numnodes++;
+	}
+
+	free(nodenums);
+}
+
+static bool ProcessSubSectorFunc(const mapview_t *map, int ssectornum, void *userdata)
+{
+	tribuild_t *b = (tribuild_t*)userdata;
+
+	if(b->ssectorchunks[ssectornum] != b->chunk)
+		BeginChunk(b, b->ssectorchunks[ssectornum]);
+
+	//SortSegs(b, map->ssectors + ssectornum);
+
+	ProcessSubSector(b, map->ssectors + ssectornum);
+
+	return true;
+}
+
+static void WalkNodes(tribuild_t *b)
+{
+	Doom_WalkBSP(b->level, NULL, ProcessSubSectorFunc, b);
+}
+
+// =============================================================
+// map building
+
+void BuildMapModel(const mapview_t *level, trimodel_t *model)
+{
+	tribuild_t	build;
+
+	memset(model, 0, sizeof(*model));
+	model->sectorsurfaces = (int*)malloc(sizeof(int) * level->numsectors);
+	memset(model->sectorsurfaces, -1, sizeof(int) * level->numsectors);
+
+	memset(&build, 0, sizeof(build));
+	build.level	= level;
+	build.model	= model;
+	build.surface	= -1;
+	build.chunk	= -1;
+
+	PlanChunks(&build);
+
+	WalkNodes(&build);
+
+	FinishChunks(model);
+
+	BuildNodes(&build);
+
+	free(build.ssectorchunks);
+	free(build.nodechunks);
+	free(build.nodeorder);
+	free(build.chunkbounds);
+	free(build.chunknums);
+}
+
@@ -0,0 +1,95 @@
+#ifndef __TRIMODEL_H__
+#define __TRIMODEL_H__
+
+#include "doomlib.h"
+#include "mdlfile.h"
+
+// map to triangle model builder
+// BuildMapModel turns a loaded map into triangles in memory, grouped into
+// surfaces and bsp chunks the same way they're laid out in a model file
+// (see mdlfile.h). it doesn't touch the filesystem so the model can be
+// used in process. FreeModel frees it. WriteTriangleModelFile writes it
+// with the given vertex format (MDL_VERTEX_PACKED or MDL_VERTEX_FLOAT),
+// returns -1 on failure. different maps can be built on different threads
+typedef dmdlvertex_t trivert_t;
+
+// a map's triangles, held in memory. vertices and indicies grow as
+// triangles are added so the model can be written in one go or handed
+// straight to whatever wants it without going through a file.
+// vertices are welded, a vertex with the same position and light level
+// as an earlier one reuses its index. hashslots holds vertex numbers,
+// -1 for an empty slot
+typedef struct trimesh_s
+{
+	trivert_t	*vertices;
+	int		numvertices;
+	int		maxvertices;
+
+	int		*indicies;
+	int		numindicies;
+	int		maxindicies;
+
+	int		*hashslots;
+	int		numhashslots;
+
+} trimesh_t;
+
+// triangles are grouped into a surface per sector and texture, each with
+// its own welded mesh. next chains the surfaces of a sector together
+typedef struct trisurface_s
+{
+	int		sector;
+	char		texture[8];
+	int		next;
+
+	trimesh_t	mesh;
+
+} trisurface_t;
+
+// a bsp subtree's worth of surfaces. the surfaces of a chunk follow one
+// another, mins and maxs come from the node bounds and the heights of
+// the chunk's vertices
+typedef struct trichunk_s
+{
+	short		mins[3];
+	short		maxs[3];
+
+	int		firstsurface;
+	int		numsurfaces;
+
+} trichunk_t;
+
+// the bsp nodes above the chunks. a child is a node number, or -1 - the
+// chunk number for a chunk. children come before their parent, the root
+// is the last node. with no nodes there's at most one chunk
+typedef struct trinode_s
+{
+	short		mins[3];
+	short		maxs[3];
+	int		children[2];
+
+} trinode_t;
+
+typedef struct trimodel_s
+{
+	trisurface_t	*surfaces;
+	int		numsurfaces;
+	int		maxsurfaces;
+
+	trichunk_t	*chunks;
+	int		numchunks;
+	int		maxchunks;
+
+	trinode_t	*nodes;
+	int		numnodes;
+
+	// first surface of each sector, -1 for none
+	int		*sectorsurfaces;
+
+} trimodel_t;
+
+void BuildMapModel(const mapview_t *level, trimodel_t *model);
+void FreeModel(trimodel_t *model);
+int WriteTriangleModelFile(const trimodel_t *model, const char *filename, int vertexformat);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include "doomlib.h"
+
+// reads every lump of a wad from several threads sharing one wadfile_t and
+// checks each one against a single threaded read of the same lump. then
+// does the same through the async reads, closing the wad while they're
+// still in flight
+
+#define NUM_THREADS	8
+#define NUM_PASSES	4
+
+static wadfile_t *wadfile;
+static unsigned char **reference;
+static int numlumps;
+
+static void Error(const char *format, ...)
+{
+	#define BUFFER_SIZE	1024
+
+        va_list valist;
+        char buffer[BUFFER_SIZE];
+
+        va_start(valist, format);
+        vsnprintf(buffer, BUFFER_SIZE, format, valist);
+        va_end(valist);
+
+        fprintf(stderr, "\x1b[31m");
+        fprintf(stderr, "Error: %s", buffer);
+        fprintf(stderr, "\x1b[0m");
+	fflush(stderr);
+        exit(1);
+}
+
+// each thread walks the lumps from a different start and stride so the
+// threads are reading different parts of the file at the same time
+static void *ReadThread(void *arg)
+{
+	int thread = (int)(size_t)arg;
+	int stride = 2 * thread + 1;
+	size_t mismatches = 0;
+
+	for (int pass = 0; pass < NUM_PASSES; pass++) {
+		for (int i = 0; i < numlumps; i++) {
+			int lumpnum = (int)(((size_t)i * stride + thread * 7919 + pass) % numlumps);
+			int size = Wad_LumpSize(wadfile, lumpnum);
+
+			unsigned char *data = (unsigned char*)Wad_ReadLump(wadfile, lumpnum);
+			if (!data || memcmp(data, reference[lumpnum], size)) {
+				fprintf(stderr, "thread %i: lump %i (%.8s) doesn't match\n", thread, lumpnum, Wad_LumpName(wadfile, lumpnum));
+				mismatches++;
+			}
+
+			Wad_FreeLump(data);
+		}
+	}
+
+	return (void*)mismatches;
+}
+
+static int asyncdone;
+static int asyncmismatches;
+
+static void AsyncReadFunc(wadfile_t *wadfile, int lumpnum, void *data, void *userdata)
+{
+	(void)userdata;
+
+	if (!data || memcmp(data, reference[lumpnum], Wad_LumpSize(wadfile, lumpnum))) {
+		__sync_fetch_and_add(&asyncmismatches, 1);
+	}
+
+	Wad_FreeLump((unsigned char*)data);
+	__sync_fetch_and_add(&asyncdone, 1);
+}
+
+int main(int argc, const char * argv[])
+{
+	if (argc < 2) {
+		printf("wadthreads <wadfile>\n");
+		exit(1);
+	}
+
+	wadfile = Wad_Open(argv[1]);
+	if (!wadfile) {
+		Error("failed to open wad file \'%s\'\n", argv[1]);
+	}
+
+	// single threaded reads to compare against
+	numlumps = Wad_NumLumps(wadfile);
+	if (!numlumps) {
+		Error("\'%s\' has no lumps\n", argv[1]);
+	}
+
+	reference = (unsigned char**)malloc(sizeof(unsigned char*) * numlumps);
+	for (int i = 0; i < numlumps; i++) {
+		reference[i] = (unsigned char*)Wad_ReadLump(wadfile, i);
+		if (!reference[i]) {
+			Error("couldn't read lump %i\n", i);
+		}
+	}
+
+	pthread_t threads[NUM_THREADS];
+	for (int i = 0; i < NUM_THREADS; i++) {
+		pthread_create(threads + i, NULL, ReadThread, (void*)(size_t)i);
+	}
+
+	size_t mismatches = 0;
+	for (int i = 0; i < NUM_THREADS; i++) {
+		void *result;
+		pthread_join(threads[i], &result);
+		mismatches += (size_t)result;
+	}
+
+	if (mismatches) {
+		Error("%i of %i threaded reads didn't match\n", (int)mismatches, NUM_THREADS * NUM_PASSES * numlumps);
+	}
+
+	// one waited read, then every lump with a callback and close straight
+	// away, Wad_Close has to wait for all of them
+	wadrequest_t *request = Wad_ReadLumpAsync(wadfile, numlumps - 1, NULL, NULL);
+	unsigned char *data = (unsigned char*)Wad_WaitLump(request);
+	if (!data || memcmp(data, reference[numlumps - 1], Wad_LumpSize(wadfile, numlumps - 1))) {
+		Error("async read of lump %i didn't match\n", numlumps - 1);
+	}
+	Wad_FreeLump(data);
+
+	for (int i = 0; i < numlumps; i++) {
+		Wad_ReadLumpAsync(wadfile, i, AsyncReadFunc, NULL);
+	}
+
+	Wad_Close(wadfile);
+
+	if (__sync_fetch_and_add(&asyncdone, 0) != numlumps || asyncmismatches) {
+		Error("%i of %i async reads finished before Wad_Close returned, %i didn't match\n", asyncdone, numlumps, asyncmismatches);
+	}
+
+	for (int i = 0; i < numlumps; i++) {
+		Wad_FreeLump(reference[i]);
+	}
+	free(reference);
+
+	printf("%i threads read %i lumps %i times each, all matched\n", NUM_THREADS, numlumps, NUM_PASSES);
+	printf("%i async reads matched and finished before Wad_Close returned\n", numlumps);
+
+	return 0;
+}